@@ -0,0 +1,290 @@
+/* Implementation of communication protocol on top of shared memory,
+ * every call is forwarded to the broker process which owns the bus */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#ifdef __linux__
+# include <linux/futex.h>
+# include <sys/syscall.h>
+#endif
+#include <time.h>
+#include <unistd.h>
+
+#include "api.h"
+#include "api_shm.h"
+#include "crc32c.h"
+
+
+/* busy loop iterations before giving CPU to other threads,
+ * liveness of the broker and call timeout are checked only then */
+#define SPIN_LIMIT 128
+
+
+static struct shm_region *_Atomic shm_region_ptr = NULL;
+
+
+static uint64_t now_ms( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+
+/* killed broker cannot clear broker_alive, so its process is checked as well */
+static int shm_broker_alive( struct shm_region *region ) {
+    if( !atomic_load_explicit( &region->broker_alive, memory_order_acquire ) )
+        return 0;
+
+    return ( kill( region->broker_pid, 0 ) == 0 ) || ( errno != ESRCH );
+}
+
+
+static struct shm_region* shm_map( void ) {
+    const char *name = getenv( SHM_NAME_ENV );
+    if( !name )
+        name = SHM_DEFAULT_NAME;
+
+    int fd = shm_open( name, O_RDWR, 0 );
+    if( fd < 0 )
+        return NULL;
+
+    void *mapped = mmap( NULL, sizeof( struct shm_region ),
+                         PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if( mapped == MAP_FAILED )
+        return NULL;
+
+    struct shm_region *region = (struct shm_region*)mapped;
+    if( ( atomic_load_explicit( &region->magic, memory_order_acquire ) != SHM_MAGIC )
+     || ( region->version != SHM_VERSION )
+     || !shm_broker_alive( region ) ) {
+        munmap( mapped, sizeof( struct shm_region ) );
+        return NULL;
+    }
+
+    return region;
+}
+
+
+/* map region created by the broker, again when the broker was restarted */
+static struct shm_region* shm_attach( void ) {
+    struct shm_region *region = atomic_load_explicit( &shm_region_ptr, memory_order_acquire );
+    if( region && shm_broker_alive( region ) )
+        return region;
+
+    struct shm_region *fresh = shm_map();
+    if( !fresh )
+        return NULL;
+
+    /* another thread can be faster, use its mapping then;
+     * old mapping is never unmapped because other threads can still use it */
+    if( !atomic_compare_exchange_strong( &shm_region_ptr, &region, fresh ) ) {
+        munmap( fresh, sizeof( struct shm_region ) );
+        return region;
+    }
+
+    return fresh;
+}
+
+
+/* wake up idle broker, region is shared between processes so futex is not private */
+static void shm_ring_doorbell( struct shm_region *region ) {
+    if( !atomic_load( &region->broker_sleeping ) )
+        return;
+
+    atomic_fetch_add( &region->doorbell, 1 );
+#ifdef __linux__
+    syscall( SYS_futex, &region->doorbell, FUTEX_WAKE, 1, NULL, NULL, 0 );
+#endif
+}
+
+
+/* bounded waiting for the broker */
+struct shm_waiter {
+    unsigned spins;
+    uint64_t deadline_ms;
+};
+
+
+/* returns zero when waiting must be stopped */
+static int shm_wait( struct shm_region *region, struct shm_waiter *waiter ) {
+    if( ++waiter->spins < SPIN_LIMIT )
+        return 1;
+
+    waiter->spins = 0;
+    if( ( now_ms() >= waiter->deadline_ms ) || !shm_broker_alive( region ) )
+        return 0;
+
+    sched_yield();
+    return 1;
+}
+
+
+/* outcome of one round trip */
+enum round_trip_status {
+    ROUND_TRIP_DONE   = 0,  // response is valid
+    ROUND_TRIP_REPEAT = 1,  // frame is broken, transaction can be repeated
+    ROUND_TRIP_FAILED = 2   // broker is gone or transaction cannot be repeated safely
+};
+
+
+/* one round trip through the ring, data_ptr is copied into the slot for writing
+ * and from the slot for reading, the broker works with the slot directly */
+static enum round_trip_status shm_round_trip( struct shm_region *region, int framed,
+                                              uint8_t op, uint8_t handle,
+                                              uint8_t upper_addr, uint8_t lower_addr,
+                                              void *data_ptr, size_t data_len,
+                                              int *result ) {
+    struct shm_waiter waiter = { 0, now_ms() + SHM_CALL_TIMEOUT_MS };
+
+    uint64_t ticket = atomic_fetch_add_explicit( &region->head, 1, memory_order_relaxed );
+    struct shm_slot *slot = &region->slots[ ticket % SHM_RING_SLOTS ];
+
+    /* wait until the owner of previous round releases the slot and claim it,
+     * on timeout the ticket is left to the broker which skips it */
+    const uint64_t free_control = SHM_CONTROL( ticket, SHM_SLOT_FREE );
+    const uint64_t writing_control = SHM_CONTROL( ticket, SHM_SLOT_WRITING );
+    uint64_t control;
+    for( ;; ) {
+        control = atomic_load_explicit( &slot->control, memory_order_acquire );
+        if( ( control == free_control )
+         && atomic_compare_exchange_strong( &slot->control, &control, writing_control ) )
+            break;
+        if( SHM_CONTROL_TICKET( control ) > ticket )
+            /* the broker has already skipped this ticket */
+            return ROUND_TRIP_FAILED;
+        if( !shm_wait( region, &waiter ) )
+            return ROUND_TRIP_FAILED;
+    }
+
+    /* slot is owned now, the broker doesn't take it back while this process lives;
+     * until the writer is known the broker takes it as alive */
+    atomic_store_explicit( &slot->writer, getpid(), memory_order_release );
+
+    struct shm_frame *frame = &slot->frame;
+    frame->seq        = (uint32_t)ticket;
+    frame->op         = op;
+    frame->handle     = handle;
+    frame->upper_addr = upper_addr;
+    frame->lower_addr = lower_addr;
+    frame->data_len   = (uint32_t)data_len;
+    frame->result     = -1;
+    memset( frame->data, 0, sizeof( frame->data ) );
+    if( ( op == SHM_OP_WRITE ) && data_len )
+        memcpy( frame->data, data_ptr, data_len );
+    if( framed )
+        slot->crc = crc32c( frame, sizeof( struct shm_frame ) );
+
+    control = writing_control;
+    if( !atomic_compare_exchange_strong( &slot->control, &control, SHM_CONTROL( ticket, SHM_SLOT_REQUEST ) ) )
+        return ROUND_TRIP_FAILED;
+    shm_ring_doorbell( region );
+
+    const uint64_t response_control = SHM_CONTROL( ticket, SHM_SLOT_RESPONSE );
+    const uint64_t rejected_control = SHM_CONTROL( ticket, SHM_SLOT_REJECTED );
+    while( ( ( control = atomic_load_explicit( &slot->control, memory_order_acquire ) ) != response_control )
+        && ( control != rejected_control ) ) {
+        if( shm_wait( region, &waiter ) )
+            continue;
+
+        /* give up, the broker releases the slot when it comes to it */
+        while( ( SHM_CONTROL_TICKET( control ) == ticket )
+            && ( control != response_control ) && ( control != rejected_control ) ) {
+            if( atomic_compare_exchange_strong( &slot->control, &control, SHM_CONTROL( ticket, SHM_SLOT_ABANDONED ) ) )
+                return ROUND_TRIP_FAILED;
+        }
+        if( ( control != response_control ) && ( control != rejected_control ) )
+            return ROUND_TRIP_FAILED;
+        break;
+    }
+
+    enum round_trip_status status = ROUND_TRIP_DONE;
+    if( control == rejected_control )
+        /* broker rejected the request without executing it */
+        status = ROUND_TRIP_REPEAT;
+    else if( framed && ( ( slot->crc != crc32c( frame, sizeof( struct shm_frame ) ) )
+                      || ( frame->seq != (uint32_t)ticket ) ) )
+        /* request is executed but response is lost, only reading can be repeated,
+         * repeated open would leak connection opened by the lost one */
+        status = ( op == SHM_OP_READ ) ? ROUND_TRIP_REPEAT : ROUND_TRIP_FAILED;
+
+    int response_result = frame->result;
+    uint8_t response_data[SHM_MAX_PAYLOAD];
+    memcpy( response_data, frame->data, sizeof( response_data ) );
+
+    /* give the slot to the next round, fails when the broker took it back after stall */
+    atomic_store_explicit( &slot->writer, 0, memory_order_relaxed );
+    if( !atomic_compare_exchange_strong( &slot->control, &control, SHM_CONTROL( ticket + SHM_RING_SLOTS, SHM_SLOT_FREE ) ) )
+        return ROUND_TRIP_FAILED;
+
+    if( status == ROUND_TRIP_DONE ) {
+        *result = response_result;
+        if( ( op == SHM_OP_READ ) && ( response_result > 0 ) )
+            memcpy( data_ptr, response_data, ( (size_t)response_result < data_len ) ? (size_t)response_result : data_len );
+    }
+
+    return status;
+}
+
+
+static int shm_transact( uint8_t op, uint8_t handle,
+                         uint8_t upper_addr, uint8_t lower_addr,
+                         void *data_ptr, size_t data_len ) {
+    if( data_len > SHM_MAX_PAYLOAD )
+        return -1;
+
+    struct shm_region *region = shm_attach();
+    if( !region )
+        return -1;
+
+    /* without frames broken data cannot be detected, so there is nothing to repeat */
+    int framed = ( region->flags & SHM_FLAG_FRAMED ) != 0;
+    int attempts = framed ? ( 1 + SHM_FRAME_RETRIES ) : 1;
+
+    for( int attempt = 0; attempt < attempts; ++attempt ) {
+        int result = -1;
+        switch( shm_round_trip( region, framed, op, handle, upper_addr, lower_addr,
+                                data_ptr, data_len, &result ) ) {
+        case ROUND_TRIP_DONE:
+            return result;
+        case ROUND_TRIP_REPEAT:
+            break;
+        case ROUND_TRIP_FAILED:
+            return -1;
+        }
+    }
+
+    return -1;
+}
+
+
+conn_h connection_open( uint8_t dev_id ) {
+    int res = shm_transact( SHM_OP_OPEN, dev_id, 0, 0, NULL, 0 );
+    if( res < 0 )
+        return INVALID_CONNECTION;
+
+    return (conn_h)res;
+}
+
+
+void connection_close( conn_h handle ) {
+    shm_transact( SHM_OP_CLOSE, handle, 0, 0, NULL, 0 );
+}
+
+
+int connection_write( conn_h handle,
+                      uint8_t upper_addr, uint8_t lower_addr,
+                      void *data_ptr, size_t data_len ) {
+    return shm_transact( SHM_OP_WRITE, handle, upper_addr, lower_addr, data_ptr, data_len );
+}
+
+
+int connection_read( conn_h handle,
+                     uint8_t upper_addr, uint8_t lower_addr,
+                     void *data_ptr, size_t data_len ) {
+    return shm_transact( SHM_OP_READ, handle, upper_addr, lower_addr, data_ptr, data_len );
+}
@@ -0,0 +1,130 @@
+/* Shared-memory transport of communication protocol:
+ * layout of the region shared between the broker and client processes */
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+
+#ifndef _DEVICE_API_SHM_H_
+#define _DEVICE_API_SHM_H_
+
+
+//! default name of shared-memory region, can be overridden by SAFE_API_SHM environment variable
+#define SHM_DEFAULT_NAME "/safe_api_bus"
+
+//! environment variable with name of shared-memory region
+#define SHM_NAME_ENV "SAFE_API_SHM"
+
+//! magic value written by the broker when region is ready to use
+#define SHM_MAGIC ( 0x53414645u )
+
+//! version of the region layout, must match between broker and clients
+#define SHM_VERSION ( 6u )
+
+//! number of slots in the ring, power of two
+#define SHM_RING_SLOTS ( 64u )
+
+//! maximum payload of one transaction, same as the limit of api_impl.c
+#define SHM_MAX_PAYLOAD ( 8u )
+
+//! client gives up a call after this time, broker is dead or ring is stuck
+#define SHM_CALL_TIMEOUT_MS ( 1000 )
+
+//! broker skips a ticket which is taken but not claimed during this time
+#define SHM_STALL_TIMEOUT_MS ( 100 )
+
+/*! flag of region: every frame carries CRC32C and is checked by receiver
+ *
+ * protects only the hop between client and broker processes: the broker seals
+ * the response after connection_read() returns, so data already broken on the
+ * bus gets a valid CRC; the bus itself needs its own check on device side */
+#define SHM_FLAG_FRAMED ( 1u << 0 )
+
+//! how many times a client repeats a transaction with broken frame
+#define SHM_FRAME_RETRIES ( 3 )
+
+
+
+//! operations which can be requested from the broker
+enum shm_op {
+    SHM_OP_OPEN  = 1,
+    SHM_OP_CLOSE = 2,
+    SHM_OP_WRITE = 3,
+    SHM_OP_READ  = 4
+};
+
+
+//! phase of one ring slot, stored together with ticket in slot control word
+enum shm_slot_phase {
+    SHM_SLOT_FREE      = 0,  // waits for client which got the ticket
+    SHM_SLOT_REQUEST   = 1,  // request is published, waits for the broker
+    SHM_SLOT_SERVING   = 2,  // request is executed by the broker
+    SHM_SLOT_RESPONSE  = 3,  // response is published, owned by the client again
+    SHM_SLOT_ABANDONED = 4,  // client gave up, the broker releases the slot
+    SHM_SLOT_REJECTED  = 5,  // request frame is broken and not executed, owned by the client again
+    SHM_SLOT_WRITING   = 6   // claimed by the client, request is being written
+};
+
+//! bits of control word used by phase, the rest is ticket
+#define SHM_PHASE_BITS ( 3 )
+#define SHM_PHASE_MASK ( ( 1u << SHM_PHASE_BITS ) - 1 )
+
+//! control word of slot for ticket in phase
+#define SHM_CONTROL( ticket, phase ) ( ( (uint64_t)( ticket ) << SHM_PHASE_BITS ) | ( phase ) )
+
+//! ticket of control word
+#define SHM_CONTROL_TICKET( control ) ( ( control ) >> SHM_PHASE_BITS )
+
+
+/*! content of one transaction, covered by CRC as a whole */
+struct shm_frame {
+    uint32_t seq;                           // ticket of request, echoed in response
+    uint8_t  op;                            // value of shm_op
+    uint8_t  handle;                        // device ID for open, connection handle otherwise
+    uint8_t  upper_addr;
+    uint8_t  lower_addr;
+    uint32_t data_len;
+    int32_t  result;                        // return value of the api call
+    uint8_t  data[SHM_MAX_PAYLOAD];         // unused bytes are zero
+};
+
+
+/*! one transaction, request and response share the same slot
+ *  so the payload is never moved between rings */
+struct shm_slot {
+    _Alignas( 64 ) _Atomic uint64_t control;  // SHM_CONTROL( ticket, phase ), slot per cache line
+    uint32_t         crc;                   // CRC32C of frame, only with SHM_FLAG_FRAMED
+    _Atomic pid_t    writer;                // process which claimed the slot, 0 until it is known
+
+    struct shm_frame frame;
+};
+
+
+/*! header of shared-memory region
+ *
+ * clients take tickets from head, the broker serves tickets in order from tail,
+ * slot for ticket T is ( T % SHM_RING_SLOTS ), the client claims it by changing
+ * SHM_CONTROL( T, SHM_SLOT_FREE ) to SHM_CONTROL( T, SHM_SLOT_WRITING ) and only
+ * then writes the frame; every change of phase is a compare-and-swap, so a client
+ * which gives up and the broker which skips a stalled ticket never take the same
+ * slot twice, and the broker never takes back a claimed slot while its writer lives */
+struct shm_region {
+    _Atomic uint32_t magic;
+    uint32_t         version;
+    uint32_t         flags;
+    _Atomic uint32_t broker_alive;  // cleared on normal exit of the broker
+    pid_t            broker_pid;    // checked by clients to notice killed broker
+
+    _Alignas( 64 ) _Atomic uint64_t head;
+    _Alignas( 64 ) _Atomic uint64_t tail;
+
+    /* idle broker sleeps on doorbell, clients ring it only when broker_sleeping is set */
+    _Alignas( 64 ) _Atomic uint32_t doorbell;
+    _Atomic uint32_t                broker_sleeping;
+
+    _Alignas( 64 ) struct shm_slot slots[SHM_RING_SLOTS];
+};
+
+
+#endif /* _DEVICE_API_SHM_H_ */
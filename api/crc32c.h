@@ -0,0 +1,31 @@
+/* CRC32C (Castagnoli) used for integrity of transport frames */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+
+#ifndef _DEVICE_CRC32C_H_
+#define _DEVICE_CRC32C_H_
+
+
+/*! \param[in] data_ptr pointer to data
+ *  \param[in] data_len size of data
+ *  \return CRC32C of data
+ *
+ * uses SSE4.2 crc32 instruction when CPU supports it, table otherwise */
+uint32_t crc32c( const void *data_ptr, size_t data_len );
+
+
+/*! \param[in] data_ptr pointer to data
+ *  \param[in] data_len size of data
+ *  \return CRC32C of data
+ *
+ * table-driven implementation, always available */
+uint32_t crc32c_table( const void *data_ptr, size_t data_len );
+
+
+/*! \return non-zero if crc32c() uses hardware instruction */
+int crc32c_hw_supported( void );
+
+
+#endif /* _DEVICE_CRC32C_H_ */
@@ -0,0 +1,87 @@
+/* Cost of CRC32C frame check of shared-memory transport,
+ * every framed transaction computes it four times: seal and check in both directions
+ *
+ * usage: frame_bench [--check], with --check only correctness is tested */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "api_shm.h"
+#include "crc32c.h"
+
+
+#define ITERATIONS 10000000u
+
+
+typedef uint32_t ( *crc_function )( const void*, size_t );
+
+
+static double now_ns( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+
+static void measure( const char *title, crc_function crc ) {
+    struct shm_frame frame;
+    memset( &frame, 0, sizeof( frame ) );
+    frame.op       = SHM_OP_WRITE;
+    frame.handle   = 1;
+    frame.data_len = sizeof( uint16_t );
+
+    /* sequence number changes every frame like in the ring */
+    uint32_t checksum = 0;
+    double start = now_ns();
+    for( uint32_t i = 0; i < ITERATIONS; ++i ) {
+        frame.seq = i;
+        checksum += crc( &frame, sizeof( frame ) );
+    }
+    double elapsed = now_ns() - start;
+
+    printf( "%-10s %6.2f ns/frame (%zu bytes, checksum %08X)\n",
+            title, elapsed / ITERATIONS, sizeof( frame ), checksum );
+}
+
+
+/* check value of the standard and agreement of both implementations
+ * for every length and alignment which the hardware path handles separately */
+static int check( void ) {
+    static const char check_data[] = "123456789";
+    if( crc32c( check_data, 9 ) != 0xE3069283u || crc32c_table( check_data, 9 ) != 0xE3069283u ) {
+        printf( "CRC32C check value mismatch\n" );
+        return 0;
+    }
+
+    uint8_t buffer[80];
+    for( size_t i = 0; i < sizeof( buffer ); ++i )
+        buffer[i] = (uint8_t)( i * 37 + 11 );
+
+    for( size_t offset = 0; offset < 8; ++offset ) {
+        for( size_t length = 0; offset + length <= sizeof( buffer ); ++length ) {
+            if( crc32c( buffer + offset, length ) != crc32c_table( buffer + offset, length ) ) {
+                printf( "CRC32C mismatch of implementations at offset %zu, length %zu\n", offset, length );
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+
+int main( int argc, char **argv ) {
+    if( !check() )
+        return 1;
+
+    if( ( argc > 1 ) && !strcmp( argv[1], "--check" ) ) {
+        printf( "CRC32C is correct (%s)\n", crc32c_hw_supported() ? "sse4.2" : "table" );
+        return 0;
+    }
+
+    measure( crc32c_hw_supported() ? "sse4.2" : "dispatch", crc32c );
+    measure( "table", crc32c_table );
+
+    return 0;
+}
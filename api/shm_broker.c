@@ -0,0 +1,296 @@
+/* Broker of shared-memory transport: owns the bus and serves requests
+ * of all client processes linked with api_shm library */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#ifdef __linux__
+# include <linux/futex.h>
+# include <sys/syscall.h>
+#endif
+#include <time.h>
+#include <unistd.h>
+
+#include "api.h"
+#include "api_shm.h"
+#include "crc32c.h"
+
+
+/* idle polls before going to sleep on doorbell, keeps latency low under load */
+#define SPIN_LIMIT 4096
+
+/* sleep on doorbell is limited, stalled tickets must be noticed */
+#define IDLE_SLEEP_NS 10000000
+
+
+static volatile sig_atomic_t stop_requested = 0;
+
+
+static void on_signal( int sig ) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+
+static uint64_t now_ms( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+
+/* sleep until a client rings the doorbell or the slot is changed,
+ * clients check broker_sleeping after publishing, broker checks slot after setting it */
+static void idle_sleep( struct shm_region *region, struct shm_slot *slot, uint64_t control ) {
+    atomic_store( &region->broker_sleeping, 1 );
+    uint32_t bell = atomic_load( &region->doorbell );
+
+    if( atomic_load( &slot->control ) == control ) {
+        struct timespec timeout = { 0, IDLE_SLEEP_NS };
+#ifdef __linux__
+        syscall( SYS_futex, &region->doorbell, FUTEX_WAIT, bell, &timeout, NULL, 0 );
+#else
+        (void)bell;
+        nanosleep( &timeout, NULL );
+#endif
+    }
+
+    atomic_store( &region->broker_sleeping, 0 );
+}
+
+
+/* region left by killed broker is removed, so its clients don't wait for nobody;
+ * returns zero when another broker is serving the same name */
+static int remove_stale_region( const char *name ) {
+    int fd = shm_open( name, O_RDWR, 0 );
+    if( fd < 0 )
+        return 1;
+
+    int stale = 1;
+    void *mapped = mmap( NULL, sizeof( struct shm_region ),
+                         PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if( mapped != MAP_FAILED ) {
+        struct shm_region *region = (struct shm_region*)mapped;
+        if( ( atomic_load_explicit( &region->magic, memory_order_acquire ) == SHM_MAGIC )
+         && atomic_load_explicit( &region->broker_alive, memory_order_acquire )
+         && ( ( kill( region->broker_pid, 0 ) == 0 ) || ( errno != ESRCH ) ) )
+            stale = 0;
+        munmap( mapped, sizeof( struct shm_region ) );
+    }
+
+    if( stale )
+        shm_unlink( name );
+    return stale;
+}
+
+
+/* execute request in place, payload stays in the slot */
+static void serve( struct shm_frame *frame ) {
+    /* length comes from client, payload buffer is only SHM_MAX_PAYLOAD bytes */
+    if( frame->data_len > SHM_MAX_PAYLOAD ) {
+        frame->result = -1;
+        return;
+    }
+
+    switch( frame->op ) {
+    case SHM_OP_OPEN: {
+        conn_h conn = connection_open( frame->handle );
+        frame->result = ( conn == INVALID_CONNECTION ) ? -1 : (int32_t)conn;
+        break;
+    }
+    case SHM_OP_CLOSE:
+        connection_close( frame->handle );
+        frame->result = 0;
+        break;
+    case SHM_OP_WRITE:
+        frame->result = connection_write( frame->handle,
+                                         frame->upper_addr, frame->lower_addr,
+                                         frame->data, frame->data_len );
+        break;
+    case SHM_OP_READ:
+        frame->result = connection_read( frame->handle,
+                                        frame->upper_addr, frame->lower_addr,
+                                        frame->data, frame->data_len );
+        break;
+    default:
+        frame->result = -1;
+        break;
+    }
+}
+
+
+/* check request frame, execute it and seal response frame,
+ * returns phase to publish: broken request is rejected without execution */
+static enum shm_slot_phase serve_framed( struct shm_slot *slot ) {
+    if( slot->crc != crc32c( &slot->frame, sizeof( struct shm_frame ) ) )
+        return SHM_SLOT_REJECTED;
+
+    serve( &slot->frame );
+    slot->crc = crc32c( &slot->frame, sizeof( struct shm_frame ) );
+    return SHM_SLOT_RESPONSE;
+}
+
+
+/* give the slot to the next round, writer of the next round is not known yet;
+ * fails when the control is changed meanwhile */
+static int release_slot( struct shm_slot *slot, uint64_t control, uint64_t next_round ) {
+    atomic_store_explicit( &slot->writer, 0, memory_order_relaxed );
+    return atomic_compare_exchange_strong( &slot->control, &control, next_round );
+}
+
+
+/* writer which is not known yet is taken as alive */
+static int writer_dead( struct shm_slot *slot ) {
+    pid_t writer = atomic_load_explicit( &slot->writer, memory_order_acquire );
+    return writer && ( kill( writer, 0 ) < 0 ) && ( errno == ESRCH );
+}
+
+
+/* usage: shm_broker [--framed] [name] */
+int main( int argc, char **argv ) {
+    const char *name = getenv( SHM_NAME_ENV );
+    uint32_t flags = 0;
+    for( int i = 1; i < argc; ++i ) {
+        if( !strcmp( argv[i], "--framed" ) )
+            flags |= SHM_FLAG_FRAMED;
+        else
+            name = argv[i];
+    }
+    if( !name )
+        name = SHM_DEFAULT_NAME;
+
+    if( !remove_stale_region( name ) ) {
+        printf( "broker: %s is already served by another broker\n", name );
+        return 1;
+    }
+
+    int fd = shm_open( name, O_CREAT | O_EXCL | O_RDWR, 0660 );
+    if( fd < 0 ) {
+        perror( "shm_open" );
+        return 1;
+    }
+    if( ftruncate( fd, sizeof( struct shm_region ) ) < 0 ) {
+        perror( "ftruncate" );
+        close( fd );
+        shm_unlink( name );
+        return 1;
+    }
+
+    void *mapped = mmap( NULL, sizeof( struct shm_region ),
+                         PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if( mapped == MAP_FAILED ) {
+        perror( "mmap" );
+        shm_unlink( name );
+        return 1;
+    }
+
+    struct shm_region *region = (struct shm_region*)mapped;
+    memset( region, 0, sizeof( struct shm_region ) );
+    for( uint32_t i = 0; i < SHM_RING_SLOTS; ++i )
+        atomic_store_explicit( &region->slots[i].control, SHM_CONTROL( i, SHM_SLOT_FREE ), memory_order_relaxed );
+    region->version    = SHM_VERSION;
+    region->flags      = flags;
+    region->broker_pid = getpid();
+    atomic_store_explicit( &region->broker_alive, 1, memory_order_relaxed );
+    /* publish region to clients */
+    atomic_store_explicit( &region->magic, SHM_MAGIC, memory_order_release );
+
+    /* log is useful also when the broker is killed */
+    setvbuf( stdout, NULL, _IOLBF, 0 );
+
+    signal( SIGINT, on_signal );
+    signal( SIGTERM, on_signal );
+
+    printf( "broker: serving %s%s\n", name, ( flags & SHM_FLAG_FRAMED ) ? " with CRC32C frames" : "" );
+
+    uint64_t tail = 0;
+    unsigned spins = 0;
+    uint64_t stalled_since = 0;
+    while( !stop_requested ) {
+        struct shm_slot *slot = &region->slots[ tail % SHM_RING_SLOTS ];
+        const uint64_t next_round = SHM_CONTROL( tail + SHM_RING_SLOTS, SHM_SLOT_FREE );
+
+        int advance = 1;
+        uint64_t control = atomic_load_explicit( &slot->control, memory_order_acquire );
+        if( control == SHM_CONTROL( tail, SHM_SLOT_REQUEST ) ) {
+            /* fails when the client gives up just now, next pass releases the slot */
+            if( !atomic_compare_exchange_strong( &slot->control, &control, SHM_CONTROL( tail, SHM_SLOT_SERVING ) ) )
+                continue;
+
+            enum shm_slot_phase phase = SHM_SLOT_RESPONSE;
+            if( flags & SHM_FLAG_FRAMED )
+                phase = serve_framed( slot );
+            else
+                serve( &slot->frame );
+
+            control = SHM_CONTROL( tail, SHM_SLOT_SERVING );
+            if( !atomic_compare_exchange_strong( &slot->control, &control, SHM_CONTROL( tail, phase ) ) )
+                /* client gave up while request was executed */
+                release_slot( slot, control, next_round );
+        }
+        else if( control == SHM_CONTROL( tail, SHM_SLOT_ABANDONED ) ) {
+            release_slot( slot, control, next_round );
+        }
+        else if( control == SHM_CONTROL( tail, SHM_SLOT_WRITING ) ) {
+            advance = 0;
+
+            /* claimed slot is taken back only from dead writer, live one can still write the frame */
+            uint64_t now = now_ms();
+            if( !stalled_since )
+                stalled_since = now;
+            else if( ( now - stalled_since >= SHM_STALL_TIMEOUT_MS )
+                  && writer_dead( slot ) && release_slot( slot, control, next_round ) ) {
+                printf( "broker: ticket %llu is skipped, its writer is dead\n", (unsigned long long)tail );
+                advance = 1;
+            }
+        }
+        else {
+            advance = 0;
+
+            /* ticket is taken but not claimed: client is slow, dead or gave up
+             * before previous owner of the slot released it */
+            if( atomic_load_explicit( &region->head, memory_order_relaxed ) > tail ) {
+                uint64_t now = now_ms();
+                if( !stalled_since )
+                    stalled_since = now;
+                else if( ( now - stalled_since >= SHM_STALL_TIMEOUT_MS )
+                      && release_slot( slot, control, next_round ) ) {
+                    printf( "broker: ticket %llu is skipped after stall\n", (unsigned long long)tail );
+                    advance = 1;
+                }
+            }
+        }
+
+        if( !advance ) {
+            if( ++spins < SPIN_LIMIT )
+                sched_yield();
+            else {
+                idle_sleep( region, slot, control );
+                spins = 0;
+            }
+            continue;
+        }
+
+        spins = 0;
+        stalled_since = 0;
+        ++tail;
+        atomic_store_explicit( &region->tail, tail, memory_order_relaxed );
+    }
+
+    /* clients waiting for response will get error */
+    atomic_store_explicit( &region->broker_alive, 0, memory_order_release );
+    atomic_store_explicit( &region->magic, 0, memory_order_release );
+
+    munmap( mapped, sizeof( struct shm_region ) );
+    shm_unlink( name );
+
+    printf( "broker: stopped\n" );
+
+    return 0;
+}
@@ -0,0 +1,465 @@
+/* Typed device access from the templates example, shared by I/O workers,
+ * every transaction goes through retry policy of the device */
+
+#ifndef _IO_WORKERS_DEVICE_H_
+#define _IO_WORKERS_DEVICE_H_
+
+#ifdef WIN32
+# include <winsock.h>
+#else
+# include <arpa/inet.h>
+#endif
+#include <array>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <optional>
+#include <thread>
+
+#include "retry_policy.h"
+
+extern "C" {
+#include <api.h>
+}
+
+class connection_exception: public std::exception {
+public:
+    connection_exception() = delete;
+    explicit connection_exception( const uint8_t dev_id ) {
+        exception_text = "cannot open communication to device #"
+            + std::to_string( dev_id );
+    }
+
+    const char* what() const throw() override {
+        return exception_text.c_str();
+    }
+
+private:
+    std::string exception_text;
+
+};
+
+/* can transaction with memory cell be repeated without side effects */
+enum class access_mode {
+    once,
+    idempotent
+};
+
+/* address contains information about data size and repeatability as well */
+template< uint8_t Upper, uint8_t Lower, typename DataType, access_mode Access = access_mode::once >
+struct address {
+    typedef DataType type;
+
+    enum {
+        UPPER      = Upper,
+        LOWER      = Lower,
+        IDEMPOTENT = ( Access == access_mode::idempotent )
+    };
+
+    address( DataType _value = 0 ):
+        value( _value ) {
+    }
+
+    DataType value;
+};
+
+
+namespace addresses {
+
+/* power on and status can be repeated, hello is a command and goes only once */
+static const address< 0x00, 0x00, uint8_t,  access_mode::idempotent > power_on( 0xFD );
+static const address< 0x10, 0xA0, uint16_t, access_mode::once >       hello;
+static const address< 0xAA, 0xFF, uint8_t,  access_mode::idempotent > ready;
+
+}
+
+
+/* reads of the device answer through this type, whatever is the size of the cell */
+typedef std::optional< uint16_t > ( *hedge_read_fn )( const conn_h conn, const uint8_t upper_addr, const uint8_t lower_addr );
+
+/* two connections of one device, each served by its own persistent thread: hedged read
+ * goes to an idle one and is duplicated to the other when it is slower than usual,
+ * the first successful answer wins and the caller does not wait for the slow one.
+ * Every connection is used by one thread at a time, the owner thread borrows an idle
+ * connection for its own transactions. Threads are started from the owner thread and
+ * inherit its CPU affinity.
+ * Backends which give one handle per device cannot have it, api_impl.c and the
+ * shared memory broker return device ID from every open */
+class hedge_lanes {
+public:
+    hedge_lanes() = delete;
+    hedge_lanes( const hedge_lanes& ) = delete;
+    hedge_lanes& operator=( const hedge_lanes& ) = delete;
+
+    hedge_lanes( const uint8_t dev_id, const conn_h owner_conn ) {
+        m_lanes[0].conn = owner_conn;
+        m_lanes[1].conn = connection_open( dev_id );
+        if( m_lanes[1].conn == INVALID_CONNECTION )
+            throw connection_exception( dev_id );
+        if( m_lanes[1].conn == owner_conn )
+            /* the same connection, it stays open for the owner */
+            throw connection_exception( dev_id );
+
+        try {
+            for( auto &l: m_lanes )
+                l.thread = std::thread( &hedge_lanes::run, this, &l );
+        }
+        catch( ... ) {
+            stop();
+            connection_close( m_lanes[1].conn );
+            throw;
+        }
+    }
+    ~hedge_lanes() {
+        stop();
+
+        /* connection of the owner is closed by the device */
+        connection_close( m_lanes[1].conn );
+    }
+
+    /* idle connection for transaction of the owner thread, until give_back()
+     * nothing else uses it; INVALID_CONNECTION when both are busy until deadline */
+    conn_h borrow( const transaction_clock::time_point deadline ) {
+        std::unique_lock< std::mutex > lock( m_lock );
+        if( !m_changed.wait_until( lock, deadline, [this]{ return idle_lane() != nullptr; } ) )
+            return INVALID_CONNECTION;
+
+        lane *l = idle_lane();
+        l->busy = true;
+        return l->conn;
+    }
+
+    void give_back( const conn_h conn ) {
+        {
+            std::lock_guard< std::mutex > lock( m_lock );
+            for( auto &l: m_lanes )
+                if( l.conn == conn )
+                    l.busy = false;
+        }
+        m_changed.notify_all();
+    }
+
+    /* read through idle connection, duplicated through the other one after threshold;
+     * read which is still running when the caller returns finishes in background */
+    std::optional< uint16_t > read( hedge_read_fn read, const uint8_t upper_addr, const uint8_t lower_addr,
+                                    const transaction_clock::duration threshold,
+                                    const transaction_clock::time_point deadline ) {
+        std::unique_lock< std::mutex > lock( m_lock );
+
+        /* answers of previous reads are not counted anymore */
+        ++m_generation;
+        m_value.reset();
+        m_launched = 0;
+        m_finished = 0;
+
+        if( !m_changed.wait_until( lock, deadline, [this]{ return idle_lane() != nullptr; } ) )
+            return std::nullopt;
+        start( *idle_lane(), read, upper_addr, lower_addr );
+
+        auto answered = [this]{ return m_value || ( m_finished == m_launched ); };
+        auto hedge_at = std::min( transaction_clock::now() + threshold, deadline );
+        if( !m_changed.wait_until( lock, hedge_at, answered ) ) {
+            if( lane *l = idle_lane() )
+                start( *l, read, upper_addr, lower_addr );
+        }
+
+        m_changed.wait_until( lock, deadline, answered );
+        return m_value;
+    }
+
+private:
+    struct lane {
+        conn_h      conn = INVALID_CONNECTION;
+        std::thread thread;
+        bool        busy = false;  // read is running or connection is borrowed
+        bool        job  = false;  // read is given but not taken by the thread yet
+
+        hedge_read_fn read       = nullptr;
+        uint8_t       upper_addr = 0;
+        uint8_t       lower_addr = 0;
+        uint64_t      generation = 0;
+    };
+
+    /* called under the lock */
+    lane* idle_lane() {
+        for( auto &l: m_lanes )
+            if( !l.busy )
+                return &l;
+        return nullptr;
+    }
+
+    /* called under the lock */
+    void start( lane &l, hedge_read_fn read, const uint8_t upper_addr, const uint8_t lower_addr ) {
+        l.busy       = true;
+        l.job        = true;
+        l.read       = read;
+        l.upper_addr = upper_addr;
+        l.lower_addr = lower_addr;
+        l.generation = m_generation;
+        ++m_launched;
+        m_changed.notify_all();
+    }
+
+    void stop() {
+        {
+            std::lock_guard< std::mutex > lock( m_lock );
+            m_stop = true;
+        }
+        m_changed.notify_all();
+        for( auto &l: m_lanes )
+            if( l.thread.joinable() )
+                l.thread.join();
+    }
+
+    void run( lane *self ) {
+        std::unique_lock< std::mutex > lock( m_lock );
+        for( ;; ) {
+            m_changed.wait( lock, [this, self]{ return m_stop || self->job; } );
+            if( m_stop )
+                return;
+
+            self->job = false;
+            auto read = self->read;
+            auto generation = self->generation;
+            lock.unlock();
+            auto res = read( self->conn, self->upper_addr, self->lower_addr );
+            lock.lock();
+
+            if( generation == m_generation ) {
+                ++m_finished;
+                if( res && !m_value )
+                    m_value = res;
+            }
+            self->busy = false;
+            m_changed.notify_all();
+        }
+    }
+
+    std::array< lane, 2 >   m_lanes;
+    std::mutex              m_lock;
+    std::condition_variable m_changed;
+    bool                    m_stop = false;
+
+    /* current read of the owner */
+    uint64_t                  m_generation = 0;
+    unsigned                  m_launched   = 0;
+    unsigned                  m_finished   = 0;
+    std::optional< uint16_t > m_value;
+
+};
+
+
+class device {
+public:
+    device() = delete;
+    device( const device& ) = delete;
+    device& operator=( const device& ) = delete;
+
+    explicit device( const uint8_t dev_id ):
+        m_dev_id( dev_id )
+      , m_conn( connection_open( dev_id ) ) {
+        if( m_conn == INVALID_CONNECTION )
+            throw connection_exception( dev_id );
+    }
+    ~device() {
+        /* reads still on the bus use the connection */
+        m_hedge.reset();
+
+        if( m_conn != INVALID_CONNECTION )
+            connection_close( m_conn );
+    }
+
+    uint8_t id() const {
+        return m_dev_id;
+    }
+
+    void set_policy( const retry_policy &policy ) {
+        if( !( policy.hedge_percentile >= 0.0 ) || ( policy.hedge_percentile > 1.0 ) )
+            throw std::invalid_argument( "hedge_percentile must be a fraction in [0, 1], got "
+                                         + std::to_string( policy.hedge_percentile ) );
+        m_policy = policy;
+    }
+
+    const retry_policy& policy() const {
+        return m_policy;
+    }
+
+    /* calls without deadline use timeout of the policy */
+
+    template< typename Data >
+    bool write( const Data &data ) {
+        return write( data, transaction_clock::now() + m_policy.timeout );
+    }
+
+    template< typename Data >
+    std::optional< typename Data::type > read( const Data &data ) {
+        return read( data, transaction_clock::now() + m_policy.timeout );
+    }
+
+    template< typename Data >
+    bool write( const Data &data, const transaction_clock::time_point deadline );
+
+    template< typename Data >
+    std::optional< typename Data::type > read( const Data &data, const transaction_clock::time_point deadline );
+
+private:
+    template< typename Operation >
+    auto with_retries( const bool idempotent, const transaction_clock::time_point deadline, Operation operation )
+        -> decltype( operation() );
+
+    template< typename Operation >
+    auto with_connection( const transaction_clock::time_point deadline, Operation operation )
+        -> decltype( operation( conn_h() ) );
+
+    template< typename Type >
+    std::optional< Type > hedged_read( const uint8_t upper_addr, const uint8_t lower_addr,
+                                       const transaction_clock::time_point deadline );
+
+    uint8_t m_dev_id = 0;
+    conn_h  m_conn   = INVALID_CONNECTION;
+
+    retry_policy                   m_policy;
+    latency_tracker                m_latency;
+    std::unique_ptr< hedge_lanes > m_hedge;
+    bool                           m_hedge_failed = false;
+
+};
+
+template< typename A >
+struct data_write;
+
+template<>
+struct data_write< uint8_t > {
+    static bool write( const conn_h conn, const uint8_t upper_addr, const uint8_t lower_addr, const uint8_t value ) {
+        uint8_t local_value = value;
+        return ( connection_write( conn, upper_addr, lower_addr, &local_value, sizeof( uint8_t ) ) >= 0 );
+    }
+};
+
+template<>
+struct data_write< uint16_t > {
+    static bool write( const conn_h conn, const uint8_t upper_addr, const uint8_t lower_addr, const uint16_t value ) {
+        uint16_t local_value = htons( value );
+        return ( connection_write( conn, upper_addr, lower_addr, &local_value, sizeof( uint16_t ) ) >= 0 );
+    }
+};
+
+template< typename A >
+struct data_read;
+
+template<>
+struct data_read< uint8_t > {
+    static std::optional< uint8_t > read( const conn_h conn, const uint8_t upper_addr, const uint8_t lower_addr ) {
+        uint8_t local_value;
+
+        if( connection_read( conn, upper_addr, lower_addr, &local_value, sizeof( uint8_t ) ) >= 0 )
+            return local_value;
+        return std::nullopt;
+    }
+};
+
+template<>
+struct data_read< uint16_t > {
+    static std::optional< uint16_t > read( const conn_h conn, const uint8_t upper_addr, const uint8_t lower_addr ) {
+        uint16_t local_value;
+
+        if( connection_read( conn, upper_addr, lower_addr, &local_value, sizeof( uint16_t ) ) >= 0 )
+            return ntohs( local_value );
+        return std::nullopt;
+    }
+};
+
+/* repeat failed transaction with growing pause while deadline allows,
+ * transaction without idempotent flag is executed once */
+template< typename Operation >
+inline auto device::with_retries( const bool idempotent, const transaction_clock::time_point deadline, Operation operation )
+    -> decltype( operation() ) {
+    const unsigned attempts = idempotent ? std::max( m_policy.max_attempts, 1u ) : 1;
+    auto backoff = m_policy.initial_backoff;
+
+    for( unsigned attempt = 1; ; ++attempt ) {
+        auto started = transaction_clock::now();
+        auto res = operation();
+        if( res ) {
+            m_latency.record( transaction_clock::now() - started );
+            return res;
+        }
+
+        auto next_try = transaction_clock::now() + backoff;
+        if( ( attempt >= attempts ) || ( next_try >= deadline ) )
+            return res;
+
+        std::this_thread::sleep_until( next_try );
+        backoff = std::min( backoff * m_policy.backoff_factor, m_policy.max_backoff );
+    }
+}
+
+/* transaction of the owner thread goes through connection which is not busy
+ * with reads of hedge lanes */
+template< typename Operation >
+inline auto device::with_connection( const transaction_clock::time_point deadline, Operation operation )
+    -> decltype( operation( conn_h() ) ) {
+    if( !m_hedge )
+        return operation( m_conn );
+
+    conn_h conn = m_hedge->borrow( deadline );
+    if( conn == INVALID_CONNECTION )
+        return {};
+
+    auto res = operation( conn );
+    m_hedge->give_back( conn );
+    return res;
+}
+
+/* read goes to a lane, when it is slower than usual the other lane sends the same read
+ * through its own connection and the first successful answer wins */
+template< typename Type >
+inline std::optional< Type > device::hedged_read( const uint8_t upper_addr, const uint8_t lower_addr,
+                                                  const transaction_clock::time_point deadline ) {
+    auto threshold = m_latency.percentile( m_policy.hedge_percentile );
+    if( threshold && !m_hedge && !m_hedge_failed ) {
+        try {
+            m_hedge = std::make_unique< hedge_lanes >( m_dev_id, m_conn );
+        }
+        catch( connection_exception& ) {
+            /* there is no second connection, reads go without duplicates */
+            m_hedge_failed = true;
+        }
+    }
+
+    if( !threshold || !m_hedge )
+        return with_connection( deadline, [&]( const conn_h conn ) {
+            return data_read< Type >::read( conn, upper_addr, lower_addr );
+        } );
+
+    auto read = []( const conn_h conn, const uint8_t upper, const uint8_t lower ) -> std::optional< uint16_t > {
+        return data_read< Type >::read( conn, upper, lower );
+    };
+    if( auto value = m_hedge->read( read, upper_addr, lower_addr, *threshold, deadline ) )
+        return static_cast< Type >( *value );
+    return std::nullopt;
+}
+
+template< typename Data >
+inline bool device::write( const Data &data, const transaction_clock::time_point deadline ) {
+    return with_retries( data.IDEMPOTENT, deadline, [&]() {
+        return with_connection( deadline, [&]( const conn_h conn ) {
+            return data_write< typename Data::type >::write( conn, data.UPPER, data.LOWER, data.value );
+        } );
+    } );
+}
+
+template< typename Data >
+inline std::optional< typename Data::type > device::read( const Data &data, const transaction_clock::time_point deadline ) {
+    return with_retries( data.IDEMPOTENT, deadline, [&]() {
+        if( data.IDEMPOTENT && ( m_policy.hedge_percentile > 0.0 ) )
+            return hedged_read< typename Data::type >( data.UPPER, data.LOWER, deadline );
+        return with_connection( deadline, [&]( const conn_h conn ) {
+            return data_read< typename Data::type >::read( conn, data.UPPER, data.LOWER );
+        } );
+    } );
+}
+
+#endif /* _IO_WORKERS_DEVICE_H_ */
@@ -0,0 +1,350 @@
+/* Per-device I/O workers: every device is owned by one thread pinned to a core,
+ * other threads hand transactions over in batches */
+
+#ifndef _IO_WORKERS_IO_WORKER_H_
+#define _IO_WORKERS_IO_WORKER_H_
+
+#ifdef __linux__
+# include <pthread.h>
+# include <sched.h>
+#endif
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "device.h"
+
+
+/* transaction executed by the worker which owns the device,
+ * returns error text like device tasks do */
+typedef std::function< std::optional< std::string >( device& ) > io_job;
+
+
+/* one worker: core to pin to and devices it owns */
+struct worker_config {
+    int core = -1; // -1 means no pinning
+    std::vector< uint8_t > devices;
+};
+
+
+/* whole text must be a number in [min_value, max_value], errors name the part of layout */
+inline int parse_layout_number( const std::string &text, const int min_value, const int max_value,
+                                const std::string &what, const std::string &worker_text ) {
+    int value = 0;
+    size_t parsed = 0;
+    try {
+        value = std::stoi( text, &parsed );
+    }
+    catch( std::logic_error& ) {
+        parsed = 0;
+    }
+
+    if( ( parsed == 0 ) || ( parsed != text.size() ) || ( value < min_value ) || ( value > max_value ) )
+        throw std::invalid_argument( "wrong " + what + " '" + text + "' in worker '" + worker_text + "'" );
+    return value;
+}
+
+
+/* layout format is "core:dev,dev;core:dev", for example "0:1,2;1:3",
+ * core can be '*' to leave the worker unpinned */
+inline std::vector< worker_config > parse_worker_layout( const std::string &layout ) {
+    std::vector< worker_config > workers;
+
+    std::stringstream layout_stream( layout );
+    std::string worker_text;
+    while( std::getline( layout_stream, worker_text, ';' ) ) {
+        if( worker_text.empty() )
+            continue;
+
+        auto colon = worker_text.find( ':' );
+        if( colon == std::string::npos )
+            throw std::invalid_argument( "worker without devices: " + worker_text );
+
+        worker_config config;
+        std::string core_text = worker_text.substr( 0, colon );
+        if( core_text != "*" )
+            config.core = parse_layout_number( core_text, 0, std::numeric_limits< int >::max(), "core", worker_text );
+
+        std::string devices_text = worker_text.substr( colon + 1 );
+        if( devices_text.empty() )
+            throw std::invalid_argument( "worker without devices: " + worker_text );
+
+        /* every comma separates two IDs, so "1," and "1,,2" have an empty one */
+        for( size_t begin = 0; begin <= devices_text.size(); ) {
+            size_t end = std::min( devices_text.find( ',', begin ), devices_text.size() );
+            config.devices.push_back( static_cast< uint8_t >(
+                parse_layout_number( devices_text.substr( begin, end - begin ), 0, 0xff, "device ID", worker_text ) ) );
+            begin = end + 1;
+        }
+
+        workers.push_back( std::move( config ) );
+    }
+
+    return workers;
+}
+
+
+/* set of transactions submitted together, results are in the order of add() */
+class io_batch {
+public:
+    void add( const uint8_t dev_id, io_job job ) {
+        m_entries.push_back( { dev_id, std::move( job ) } );
+    }
+
+    size_t size() const {
+        return m_entries.size();
+    }
+
+    void wait() {
+        std::unique_lock< std::mutex > lock( m_lock );
+        m_done.wait( lock, [this]{ return m_pending == 0; } );
+    }
+
+    const std::vector< std::optional< std::string > >& results() const {
+        return m_results;
+    }
+
+private:
+    friend class io_workers;
+
+    struct entry {
+        uint8_t dev_id;
+        io_job  job;
+    };
+
+    void start() {
+        m_results.assign( m_entries.size(), std::nullopt );
+        m_pending = m_entries.size();
+    }
+
+    void complete( const size_t count ) {
+        std::lock_guard< std::mutex > lock( m_lock );
+        m_pending -= count;
+        if( m_pending == 0 )
+            m_done.notify_all();
+    }
+
+    std::vector< entry > m_entries;
+    std::vector< std::optional< std::string > > m_results;
+
+    std::mutex              m_lock;
+    std::condition_variable m_done;
+    size_t                  m_pending = 0;
+
+};
+
+
+class io_workers {
+public:
+    io_workers() = delete;
+    io_workers( const io_workers& ) = delete;
+    io_workers& operator=( const io_workers& ) = delete;
+
+    explicit io_workers( const std::vector< worker_config > &layout ) {
+        m_owner.fill( -1 );
+
+        for( const auto &config: layout ) {
+            for( auto dev_id: config.devices ) {
+                if( m_owner[dev_id] >= 0 )
+                    throw std::invalid_argument( "device #" + std::to_string( dev_id )
+                                                 + " is assigned to several workers" );
+                m_owner[dev_id] = static_cast< int >( m_workers.size() );
+            }
+            m_workers.push_back( std::make_unique< worker >( config ) );
+        }
+
+        /* workers which are already running must be stopped if something fails,
+         * joinable thread in destroyed worker terminates the process */
+        try {
+            for( auto &w: m_workers )
+                w->thread = std::thread( &io_workers::run, w.get() );
+
+            /* worker without requested core is useless, report it to the caller */
+            for( auto &w: m_workers ) {
+                std::unique_lock< std::mutex > lock( w->lock );
+                w->wakeup.wait( lock, [&w]{ return w->started; } );
+                if( !w->start_error.empty() )
+                    throw std::runtime_error( w->start_error );
+            }
+        }
+        catch( ... ) {
+            stop();
+            throw;
+        }
+    }
+
+    ~io_workers() {
+        stop();
+    }
+
+    /* split batch by owners and hand over every part with one lock,
+     * batch must stay alive until wait() returns */
+    void submit( io_batch &batch ) {
+        batch.start();
+
+        std::vector< std::vector< item > > parts( m_workers.size() );
+        size_t rejected = 0;
+        for( size_t i = 0; i < batch.m_entries.size(); ++i ) {
+            int owner = m_owner[ batch.m_entries[i].dev_id ];
+            if( owner < 0 ) {
+                batch.m_results[i] = "device #" + std::to_string( batch.m_entries[i].dev_id )
+                                   + " is not served by any worker";
+                ++rejected;
+                continue;
+            }
+            parts[owner].push_back( { &batch, i } );
+        }
+
+        for( size_t w = 0; w < parts.size(); ++w ) {
+            if( parts[w].empty() )
+                continue;
+
+            worker &target = *m_workers[w];
+            std::lock_guard< std::mutex > lock( target.lock );
+            target.inbox.insert( target.inbox.end(), parts[w].begin(), parts[w].end() );
+            target.wakeup.notify_one();
+        }
+
+        if( rejected )
+            batch.complete( rejected );
+    }
+
+    /* convenience: submit and wait */
+    void execute( io_batch &batch ) {
+        submit( batch );
+        batch.wait();
+    }
+
+private:
+    struct item {
+        io_batch *batch;
+        size_t    index;
+    };
+
+    struct worker {
+        explicit worker( const worker_config &_config ):
+            config( _config ) {
+        }
+
+        worker_config config;
+        std::thread   thread;
+
+        std::mutex              lock;
+        std::condition_variable wakeup;
+        std::vector< item >     inbox;
+        bool                    stop    = false;
+        bool                    started = false;
+        std::string             start_error;
+    };
+
+    void stop() {
+        for( auto &w: m_workers ) {
+            std::lock_guard< std::mutex > lock( w->lock );
+            w->stop = true;
+            w->wakeup.notify_all();
+        }
+        for( auto &w: m_workers )
+            if( w->thread.joinable() )
+                w->thread.join();
+    }
+
+    /* returns error text, empty when worker is pinned or pinning is not requested */
+    static std::string pin_to_core( const int core ) {
+        if( core < 0 )
+            return std::string();
+
+#ifdef __linux__
+        if( core >= CPU_SETSIZE )
+            return "core #" + std::to_string( core ) + " is out of range";
+
+        cpu_set_t cpu_set;
+        CPU_ZERO( &cpu_set );
+        CPU_SET( core, &cpu_set );
+        int res = pthread_setaffinity_np( pthread_self(), sizeof( cpu_set ), &cpu_set );
+        if( res != 0 )
+            return "cannot pin worker to core #" + std::to_string( core ) + ": " + std::strerror( res );
+        return std::string();
+#else
+        return "cannot pin worker to core #" + std::to_string( core ) + ": not supported, use '*'";
+#endif
+    }
+
+    static void run( worker *self ) {
+        {
+            std::lock_guard< std::mutex > lock( self->lock );
+            self->start_error = pin_to_core( self->config.core );
+            self->started = true;
+            self->wakeup.notify_all();
+            if( !self->start_error.empty() )
+                return;
+        }
+
+        /* devices are opened by the owner thread so driver state stays on its core */
+        std::array< std::unique_ptr< device >, 256 > devices;
+        std::array< std::string, 256 >               open_errors;
+        for( auto dev_id: self->config.devices ) {
+            try {
+                devices[dev_id] = std::make_unique< device >( dev_id );
+            }
+            catch( connection_exception &ex ) {
+                open_errors[dev_id] = ex.what();
+            }
+        }
+
+        std::vector< item > batch;
+        for( ;; ) {
+            {
+                std::unique_lock< std::mutex > lock( self->lock );
+                self->wakeup.wait( lock, [self]{ return self->stop || !self->inbox.empty(); } );
+                if( self->inbox.empty() )
+                    break;
+                /* take everything queued so far, vector capacity is reused */
+                batch.swap( self->inbox );
+            }
+
+            for( auto &it: batch ) {
+                auto &entry = it.batch->m_entries[it.index];
+                auto &dev = devices[entry.dev_id];
+                if( !dev ) {
+                    it.batch->m_results[it.index] = open_errors[entry.dev_id];
+                    continue;
+                }
+
+                /* exception must not kill the worker together with other devices */
+                try {
+                    it.batch->m_results[it.index] = entry.job( *dev );
+                }
+                catch( std::exception &ex ) {
+                    it.batch->m_results[it.index] = std::string( ex.what() );
+                }
+            }
+
+            /* results go back with one notification per submitted batch */
+            size_t run_start = 0;
+            for( size_t i = 1; i <= batch.size(); ++i ) {
+                if( ( i == batch.size() ) || ( batch[i].batch != batch[run_start].batch ) ) {
+                    batch[run_start].batch->complete( i - run_start );
+                    run_start = i;
+                }
+            }
+            batch.clear();
+        }
+    }
+
+    std::vector< std::unique_ptr< worker > > m_workers;
+    std::array< int, 256 >                   m_owner;
+
+};
+
+#endif /* _IO_WORKERS_IO_WORKER_H_ */
@@ -0,0 +1,103 @@
+/* Example of typed device access where every device is owned by one pinned I/O worker,
+ * tasks are handed over to the owner instead of calling the API from any thread */
+
+#ifdef __linux__
+# include <sched.h>
+#endif
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "device.h"
+#include "io_worker.h"
+
+
+/* device 1 and device 2 are served by different cores when the process may run on
+ * enough of them, can be changed by SAFE_API_WORKERS environment variable */
+static std::string default_layout() {
+#ifdef __linux__
+    /* cores of the machine can be forbidden by taskset or cgroup, pinning to them fails */
+    cpu_set_t allowed;
+    CPU_ZERO( &allowed );
+    if( sched_getaffinity( 0, sizeof( allowed ), &allowed ) == 0 ) {
+        std::vector< int > cores;
+        for( int core = 0; ( core < CPU_SETSIZE ) && ( cores.size() < 2 ); ++core )
+            if( CPU_ISSET( core, &allowed ) )
+                cores.push_back( core );
+
+        if( !cores.empty() ) {
+            const int second = cores.back();
+            return std::to_string( cores.front() ) + ":1;" + std::to_string( second ) + ":2";
+        }
+    }
+#endif
+    return "*:1;*:2";
+}
+
+
+std::optional< std::string > device1_task( device &dev ) {
+    if( !dev.write( addresses::power_on ) )
+        return std::string( "cannot send command to power on" );
+
+    /* device has 5 ms to become ready, failed reads are repeated within it */
+    uint8_t ready_value;
+    if( auto res = dev.read( addresses::ready, transaction_clock::now() + std::chrono::milliseconds( 5 ) ) ) {
+        ready_value = *res;
+    }
+    else
+        return std::string( "cannot read status of the device" );
+
+    if( ready_value != 42 )
+        return std::string( "device doesn't ready" );
+
+    auto hello = addresses::hello;
+    hello.value = 0x100;
+    if( !dev.write( hello ) )
+        return std::string( "cannot send hello command" );
+
+    return std::nullopt;
+}
+
+
+std::optional< std::string > device2_task( device &dev ) {
+    auto hello = addresses::hello;
+    hello.value = 0x100;
+    if( !dev.write( hello ) )
+        return std::string( "cannot send hello command" );
+
+    return std::nullopt;
+}
+
+
+int main() {
+    const char *layout = std::getenv( "SAFE_API_WORKERS" );
+
+    std::unique_ptr< io_workers > workers;
+    try {
+        workers = std::make_unique< io_workers >( parse_worker_layout( layout ? layout : default_layout() ) );
+    }
+    catch( std::exception &ex ) {
+        std::cout << "Cannot start I/O workers: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    /* both tasks are handed over at once, each owner gets its part with one lock */
+    io_batch batch;
+    batch.add( 1, device1_task );
+    batch.add( 2, device2_task );
+    workers->execute( batch );
+
+    if( auto &res = batch.results()[0] )
+        std::cout << "Communication with first device failed"
+                  << *res
+                  << std::endl;
+
+    if( auto &res = batch.results()[1] )
+        std::cout << "Communication with second device failed"
+                  << *res
+                  << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,83 @@
+/* Retry policy of device transactions: deadline, exponential backoff
+ * and hedged duplicate reads when latency goes above usual */
+
+#ifndef _IO_WORKERS_RETRY_POLICY_H_
+#define _IO_WORKERS_RETRY_POLICY_H_
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <optional>
+
+
+typedef std::chrono::steady_clock transaction_clock;
+
+
+struct retry_policy {
+    /* deadline of call when caller doesn't give its own */
+    std::chrono::microseconds timeout = std::chrono::milliseconds( 20 );
+
+    /* attempts of idempotent transaction, others are executed once */
+    unsigned max_attempts = 3;
+
+    std::chrono::microseconds initial_backoff = std::chrono::microseconds( 100 );
+    std::chrono::microseconds max_backoff     = std::chrono::milliseconds( 5 );
+    unsigned                  backoff_factor  = 2;
+
+    /* idempotent read is duplicated when it takes longer than this fraction
+     * of recent successful calls, in (0, 1]: 0.99 is p99; 0 disables hedging */
+    double hedge_percentile = 0.0;
+};
+
+
+/* latencies of recent successful transactions of one device */
+class latency_tracker {
+public:
+    void record( const transaction_clock::duration latency ) {
+        m_samples[ m_next ] = latency;
+        m_next = ( m_next + 1 ) % samples_count;
+        if( m_size < samples_count )
+            ++m_size;
+
+        /* sorting on every call is too expensive, threshold is refreshed periodically */
+        if( ++m_since_update >= update_period )
+            m_threshold.reset();
+    }
+
+    /* p is a fraction in (0, 1], nothing until there is enough history */
+    std::optional< transaction_clock::duration > percentile( const double p ) {
+        if( m_size < min_samples )
+            return std::nullopt;
+
+        if( !m_threshold || ( m_threshold_p != p ) ) {
+            std::array< transaction_clock::duration, samples_count > sorted;
+            std::copy_n( m_samples.begin(), m_size, sorted.begin() );
+
+            size_t rank = std::min( m_size - 1, static_cast< size_t >( p * m_size ) );
+            std::nth_element( sorted.begin(), sorted.begin() + rank, sorted.begin() + m_size );
+
+            m_threshold    = sorted[rank];
+            m_threshold_p  = p;
+            m_since_update = 0;
+        }
+
+        return m_threshold;
+    }
+
+private:
+    static constexpr size_t samples_count = 256;
+    static constexpr size_t min_samples   = 32;
+    static constexpr size_t update_period = 32;
+
+    std::array< transaction_clock::duration, samples_count > m_samples {};
+    size_t m_next = 0;
+    size_t m_size = 0;
+
+    std::optional< transaction_clock::duration > m_threshold;
+    double m_threshold_p  = 0.0;
+    size_t m_since_update = 0;
+
+};
+
+#endif /* _IO_WORKERS_RETRY_POLICY_H_ */
@@ -0,0 +1,154 @@
+/* Simulated bus with injected faults for tests of retry policy: transactions can fail
+ * or answer late; like real backends it gives device ID as handle, optionally every
+ * connection gets its own handle as on a bus with several channels per device */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+extern "C" {
+#include <api.h>
+}
+
+#include "fault_api.h"
+
+
+namespace {
+
+std::mutex lock;
+
+std::atomic< unsigned > failures { 0 };
+
+conn_h                    slow_handle = INVALID_CONNECTION;
+std::chrono::microseconds slow_delay { 0 };
+bool                      slow_fails  = false;
+
+bool          distinct       = false;
+conn_h        next_handle    = 0;
+bool          opened[256]    = {};
+unsigned      bad_closes     = 0;
+unsigned long calls[256]     = {};
+unsigned      in_flight[256] = {};
+unsigned      max_in_flight  = 0;
+
+
+/* common part of read and write, returns false when the call must fail */
+bool transaction( const conn_h handle ) {
+    std::chrono::microseconds delay { 0 };
+    bool fails = false;
+    {
+        std::lock_guard< std::mutex > guard( lock );
+        ++calls[handle];
+        max_in_flight = std::max( max_in_flight, ++in_flight[handle] );
+        if( handle == slow_handle ) {
+            delay = slow_delay;
+            fails = slow_fails;
+        }
+    }
+
+    if( delay.count() )
+        std::this_thread::sleep_for( delay );
+
+    unsigned pending = failures.load();
+    while( pending && !failures.compare_exchange_weak( pending, pending - 1 ) )
+        ;
+
+    std::lock_guard< std::mutex > guard( lock );
+    --in_flight[handle];
+    return !fails && !pending;
+}
+
+}
+
+
+void fault_fail_next( const unsigned count ) {
+    failures.store( count );
+}
+
+
+void fault_slow_handle( const conn_h handle, const std::chrono::microseconds delay, const bool fail ) {
+    std::lock_guard< std::mutex > guard( lock );
+    slow_handle = handle;
+    slow_delay  = delay;
+    slow_fails  = fail;
+}
+
+
+unsigned long fault_calls( const conn_h handle ) {
+    std::lock_guard< std::mutex > guard( lock );
+    return calls[handle];
+}
+
+
+unsigned fault_max_in_flight() {
+    std::lock_guard< std::mutex > guard( lock );
+    return max_in_flight;
+}
+
+
+void fault_distinct_handles( const bool enable ) {
+    std::lock_guard< std::mutex > guard( lock );
+    distinct = enable;
+}
+
+
+unsigned fault_bad_closes() {
+    std::lock_guard< std::mutex > guard( lock );
+    return bad_closes;
+}
+
+
+extern "C" {
+
+/* handle is device ID, with distinct handles they are given in order of opening: 1, 2, ... */
+conn_h connection_open( uint8_t dev_id ) {
+    if( ( !dev_id ) || ( dev_id > 5 ) )
+        return INVALID_CONNECTION;
+
+    std::lock_guard< std::mutex > guard( lock );
+    conn_h handle = dev_id;
+    if( distinct ) {
+        if( next_handle == 254 )
+            return INVALID_CONNECTION;
+        handle = ++next_handle;
+    }
+    opened[handle] = true;
+    return handle;
+}
+
+
+void connection_close( conn_h handle ) {
+    std::lock_guard< std::mutex > guard( lock );
+    if( !opened[handle] )
+        ++bad_closes;
+    opened[handle] = false;
+}
+
+
+int connection_write( conn_h handle,
+                      uint8_t upper_addr, uint8_t lower_addr,
+                      void *data_ptr, size_t data_len ) {
+    (void)upper_addr; (void)lower_addr; (void)data_ptr;
+    if( ( !data_len ) || ( data_len > 8 ) || !transaction( handle ) )
+        return -1;
+
+    return (int)data_len;
+}
+
+
+int connection_read( conn_h handle,
+                     uint8_t upper_addr, uint8_t lower_addr,
+                     void *data_ptr, size_t data_len ) {
+    (void)upper_addr; (void)lower_addr;
+    if( ( !data_len ) || ( data_len > 8 ) || !transaction( handle ) )
+        return -1;
+
+    std::memset( data_ptr, 0, data_len );
+    *static_cast< uint8_t* >( data_ptr ) = 42; // universal answer
+    return (int)data_len;
+}
+
+}
@@ -0,0 +1,30 @@
+/* Control of simulated bus with injected faults, see fault_api.cpp */
+
+#ifndef _TEST_FAULT_API_H_
+#define _TEST_FAULT_API_H_
+
+#include <chrono>
+
+extern "C" {
+#include <api.h>
+}
+
+/* next count transactions of any connection fail */
+void fault_fail_next( const unsigned count );
+
+/* every transaction of the handle takes delay and then fails when fail is set */
+void fault_slow_handle( const conn_h handle, const std::chrono::microseconds delay, const bool fail );
+
+/* transactions started through the handle */
+unsigned long fault_calls( const conn_h handle );
+
+/* most transactions which were running at the same time through one handle */
+unsigned fault_max_in_flight();
+
+/* every open gives a new handle instead of device ID, must be set before opening */
+void fault_distinct_handles( const bool enable );
+
+/* closes of handles which were not open, e.g. closed twice */
+unsigned fault_bad_closes();
+
+#endif /* _TEST_FAULT_API_H_ */
@@ -0,0 +1,88 @@
+/* Tests of worker layout parsing of I/O workers
+ *
+ * usage: layout_test --case <valid|rejected> */
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include "io_worker.h"
+
+
+static void expect( const bool condition, const std::string &text ) {
+    if( !condition )
+        throw std::runtime_error( text );
+}
+
+
+/* cores, unpinned workers and device lists are read as written */
+static void test_valid() {
+    auto layout = parse_worker_layout( "0:1,2;*:3;;7:255" );
+
+    expect( layout.size() == 3, "3 workers expected, got " + std::to_string( layout.size() ) );
+    expect( ( layout[0].core == 0 ) && ( layout[0].devices == std::vector< uint8_t >{ 1, 2 } ), "wrong first worker" );
+    expect( ( layout[1].core == -1 ) && ( layout[1].devices == std::vector< uint8_t >{ 3 } ), "wrong unpinned worker" );
+    expect( ( layout[2].core == 7 ) && ( layout[2].devices == std::vector< uint8_t >{ 255 } ), "wrong last worker" );
+}
+
+
+/* every broken worker is reported as invalid argument which names it */
+static void test_rejected() {
+    static const struct {
+        const char *layout;
+        const char *worker;
+    } broken[] = {
+        { "1",              "1"              }, // no devices
+        { "1:",             "1:"             },
+        { "0:1;1:",         "1:"             },
+        { "-3:1",           "-3:1"           }, // negative core
+        { "x:1",            "x:1"            },
+        { "1x:1",           "1x:1"           },
+        { ":1",             ":1"             },
+        { "0:1,",           "0:1,"           }, // empty device ID
+        { "0:1,,2",         "0:1,,2"         },
+        { "0:256",          "0:256"          },
+        { "0:-1",           "0:-1"           },
+        { "0:a",            "0:a"            },
+        { "0:99999999999",  "0:99999999999"  }
+    };
+
+    for( auto &entry: broken ) {
+        try {
+            parse_worker_layout( entry.layout );
+        }
+        catch( std::invalid_argument &ex ) {
+            expect( std::string( ex.what() ).find( entry.worker ) != std::string::npos,
+                    std::string( "error of '" ) + entry.layout + "' doesn't name the worker: " + ex.what() );
+            continue;
+        }
+        throw std::runtime_error( std::string( "layout '" ) + entry.layout + "' is accepted" );
+    }
+}
+
+
+int main( int argc, char **argv ) {
+    if( ( argc != 3 ) || ( std::string( argv[1] ) != "--case" ) ) {
+        std::cout << "usage: layout_test --case <valid|rejected>" << std::endl;
+        return 2;
+    }
+
+    const std::string name = argv[2];
+    try {
+        if( name == "valid" )
+            test_valid();
+        else if( name == "rejected" )
+            test_rejected();
+        else {
+            std::cout << "unknown case: " << name << std::endl;
+            return 2;
+        }
+    }
+    catch( std::exception &ex ) {
+        std::cout << name << ": " << ex.what() << std::endl;
+        return 1;
+    }
+
+    std::cout << name << ": ok" << std::endl;
+    return 0;
+}
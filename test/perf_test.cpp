@@ -0,0 +1,518 @@
+/* Performance regression test of typed device API on simulated bus:
+ * transactions and allocations per task are compared with committed counts,
+ * timings are compared with baseline recorded on the same machine or,
+ * when there is none, with committed reference of the build type
+ *
+ * usage: perf_test --workload <hello|bulk|batched> --reference <file> --baseline <file>
+ *                  [--config <name>] [--tolerance <percent>]
+ *                  [--reference-tolerance <percent>] [--record]
+ *
+ * timings are relative to reference task which sends the same kind of transactions
+ * straight through the API in the same process, so load of the machine affects both sides
+ * and the ratios move much less between machines than absolute numbers;
+ * throughput and p99 latency are checked only as such ratios, absolute
+ * transactions per second and microseconds are printed for information */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "device.h"
+#include "io_worker.h"
+
+
+unsigned long sim_transactions();
+
+
+/* every operator new of the process is counted */
+
+static std::atomic< unsigned long > allocations { 0 };
+
+void* operator new( std::size_t size ) {
+    allocations.fetch_add( 1, std::memory_order_relaxed );
+    if( void *ptr = std::malloc( size ? size : 1 ) )
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete( void *ptr ) noexcept {
+    std::free( ptr );
+}
+
+void operator delete( void *ptr, std::size_t ) noexcept {
+    std::free( ptr );
+}
+
+
+/* the same tasks as in the examples */
+
+std::optional< std::string > device1_task( device &dev ) {
+    if( !dev.write( addresses::power_on ) )
+        return std::string( "cannot send command to power on" );
+
+    auto res = dev.read( addresses::ready );
+    if( !res )
+        return std::string( "cannot read status of the device" );
+    if( *res != 42 )
+        return std::string( "device doesn't ready" );
+
+    auto hello = addresses::hello;
+    hello.value = 0x100;
+    if( !dev.write( hello ) )
+        return std::string( "cannot send hello command" );
+
+    return std::nullopt;
+}
+
+std::optional< std::string > device2_task( device &dev ) {
+    auto hello = addresses::hello;
+    hello.value = 0x100;
+    if( !dev.write( hello ) )
+        return std::string( "cannot send hello command" );
+
+    return std::nullopt;
+}
+
+
+/* task of bulk workloads: transactions on already opened device */
+static const unsigned bulk_task_size = 64;
+
+std::optional< std::string > bulk_task( device &dev ) {
+    auto hello = addresses::hello;
+    for( unsigned i = 0; i < bulk_task_size / 2; ++i ) {
+        hello.value = static_cast< uint16_t >( i );
+        if( !dev.write( hello ) )
+            return std::string( "cannot send hello command" );
+        if( !dev.read( addresses::ready ) )
+            return std::string( "cannot read status of the device" );
+    }
+
+    return std::nullopt;
+}
+
+
+/* reference tasks: the same transactions without typed device, handle of simulated bus is device id */
+
+std::optional< std::string > raw_bulk_task( const conn_h conn ) {
+    for( unsigned i = 0; i < bulk_task_size / 2; ++i ) {
+        uint16_t value = htons( static_cast< uint16_t >( i ) );
+        if( connection_write( conn, addresses::hello.UPPER, addresses::hello.LOWER, &value, sizeof( value ) ) < 0 )
+            return std::string( "cannot send hello command" );
+        uint8_t ready;
+        if( connection_read( conn, addresses::ready.UPPER, addresses::ready.LOWER, &ready, sizeof( ready ) ) < 0 )
+            return std::string( "cannot read status of the device" );
+    }
+
+    return std::nullopt;
+}
+
+std::optional< std::string > raw_hello_task() {
+    conn_h conn1 = connection_open( 1 );
+    uint8_t power_on = addresses::power_on.value;
+    uint8_t ready;
+    uint16_t hello = htons( 0x100 );
+    bool failed = ( connection_write( conn1, addresses::power_on.UPPER, addresses::power_on.LOWER, &power_on, sizeof( power_on ) ) < 0 )
+               || ( connection_read( conn1, addresses::ready.UPPER, addresses::ready.LOWER, &ready, sizeof( ready ) ) < 0 )
+               || ( connection_write( conn1, addresses::hello.UPPER, addresses::hello.LOWER, &hello, sizeof( hello ) ) < 0 );
+    connection_close( conn1 );
+
+    conn_h conn2 = connection_open( 2 );
+    failed = failed || ( connection_write( conn2, addresses::hello.UPPER, addresses::hello.LOWER, &hello, sizeof( hello ) ) < 0 );
+    connection_close( conn2 );
+
+    if( failed )
+        return std::string( "reference transaction failed" );
+    return std::nullopt;
+}
+
+
+/* reference is repeated to take about as long as the task,
+ * then interrupts and other noise of the machine hit both equally often */
+template< typename Task >
+static std::function< std::optional< std::string >() > repeated( const unsigned times, Task task ) {
+    return [times, task]() -> std::optional< std::string > {
+        for( unsigned i = 0; i < times; ++i )
+            if( auto res = task() )
+                return res;
+        return std::nullopt;
+    };
+}
+
+
+/* one workload: task and its reference are called in turns and measured one by one */
+struct workload {
+    unsigned tasks;
+    std::function< void() > prepare;
+    std::function< std::optional< std::string >() > task;
+    std::function< std::optional< std::string >() > reference;
+    std::function< void() > cleanup;
+};
+
+
+static workload make_workload( const std::string &name ) {
+    /* POWER_ON/READY/HELLO with device 1 and HELLO with device 2, connection per task */
+    if( name == "hello" )
+        return {
+            50000,
+            []{},
+            []() -> std::optional< std::string > {
+                try {
+                    device dev1( 1 );
+                    if( auto res = device1_task( dev1 ) )
+                        return res;
+                    device dev2( 2 );
+                    return device2_task( dev2 );
+                }
+                catch( connection_exception &ex ) {
+                    return std::string( ex.what() );
+                }
+            },
+            repeated( 14, raw_hello_task ),
+            []{}
+        };
+
+    /* many transactions on one opened device */
+    if( name == "bulk" ) {
+        auto dev = std::make_shared< std::unique_ptr< device > >();
+        return {
+            5000,
+            [dev]{ *dev = std::make_unique< device >( 1 ); },
+            [dev]{ return bulk_task( **dev ); },
+            repeated( 16, []{ return raw_bulk_task( 1 ); } ),
+            [dev]{ dev->reset(); }
+        };
+    }
+
+    /* bulk tasks for two devices handed over to I/O workers in one batch,
+     * reference goes through the same workers */
+    if( name == "batched" ) {
+        auto workers = std::make_shared< std::unique_ptr< io_workers > >();
+        auto run = [workers]( io_job job ) -> std::optional< std::string > {
+            io_batch batch;
+            batch.add( 1, job );
+            batch.add( 2, job );
+            ( *workers )->execute( batch );
+            for( auto &res: batch.results() )
+                if( res )
+                    return res;
+            return std::nullopt;
+        };
+        return {
+            2000,
+            [workers]{ *workers = std::make_unique< io_workers >( parse_worker_layout( "*:1;*:2" ) ); },
+            [run]{ return run( bulk_task ); },
+            [run]{ return run( []( device &dev ){ return repeated( 16, [&dev]{ return raw_bulk_task( dev.id() ); } )(); } ); },
+            [workers]{ workers->reset(); }
+        };
+    }
+
+    throw std::invalid_argument( "unknown workload: " + name );
+}
+
+
+/* one run of the workload, times in seconds */
+struct run_result {
+    double tx_per_task     = 0.0;
+    double allocs_per_task = 0.0;
+    double elapsed           = 0.0;
+    double reference_elapsed = 0.0;
+    double p99               = 0.0;
+    double reference_p99     = 0.0;
+};
+
+
+struct metrics {
+    /* exact, the same on every machine */
+    double tx_per_task     = 0.0;
+    double allocs_per_task = 0.0;
+
+    /* relative to reference task */
+    double relative_throughput = 0.0;
+    double relative_p99        = 0.0;
+
+    /* absolute, only for information */
+    double tx_per_sec     = 0.0;
+    double p99_latency_us = 0.0;
+};
+
+
+typedef std::chrono::steady_clock measure_clock;
+
+static double p99( std::vector< measure_clock::duration > &latencies ) {
+    size_t rank = std::min( latencies.size() - 1, latencies.size() * 99 / 100 );
+    std::nth_element( latencies.begin(), latencies.begin() + rank, latencies.end() );
+    return std::chrono::duration< double >( latencies[rank] ).count();
+}
+
+
+static run_result measure_once( workload &load ) {
+    std::vector< measure_clock::duration > latencies, reference_latencies;
+    latencies.reserve( load.tasks );
+    reference_latencies.reserve( load.tasks );
+
+    load.prepare();
+
+    /* warm up caches and lazy initialization */
+    for( unsigned i = 0; i < load.tasks / 10; ++i ) {
+        load.task();
+        load.reference();
+    }
+
+    measure_clock::duration elapsed {}, reference_elapsed {};
+    unsigned long tx_count = 0, allocation_count = 0;
+    for( unsigned i = 0; i < load.tasks; ++i ) {
+        /* order is changed every time, so neither side gets warmer caches */
+        for( unsigned side = 0; side < 2; ++side ) {
+            if( ( side + i ) % 2 ) {
+                auto started = measure_clock::now();
+                if( auto res = load.reference() )
+                    throw std::runtime_error( "reference task failed: " + *res );
+                reference_latencies.push_back( measure_clock::now() - started );
+                reference_elapsed += reference_latencies.back();
+                continue;
+            }
+
+            unsigned long tx_before = sim_transactions();
+            unsigned long allocations_before = allocations.load();
+            auto started = measure_clock::now();
+            if( auto res = load.task() )
+                throw std::runtime_error( "task failed: " + *res );
+            latencies.push_back( measure_clock::now() - started );
+            allocation_count += allocations.load() - allocations_before;
+            tx_count += sim_transactions() - tx_before;
+            elapsed += latencies.back();
+        }
+    }
+
+    load.cleanup();
+
+    run_result result;
+    result.tx_per_task       = static_cast< double >( tx_count ) / load.tasks;
+    result.allocs_per_task   = static_cast< double >( allocation_count ) / load.tasks;
+    result.elapsed           = std::chrono::duration< double >( elapsed ).count();
+    result.reference_elapsed = std::chrono::duration< double >( reference_elapsed ).count();
+    result.p99               = p99( latencies );
+    result.reference_p99     = p99( reference_latencies );
+    return result;
+}
+
+
+/* noise of the machine only adds time, so every time is the best of several runs
+ * and ratios are taken from them; counts are the worst of runs */
+static metrics measure( workload &load ) {
+    static const unsigned runs = 7;
+
+    run_result best = measure_once( load );
+    for( unsigned i = 1; i < runs; ++i ) {
+        run_result current = measure_once( load );
+        best.tx_per_task       = std::max( best.tx_per_task, current.tx_per_task );
+        best.allocs_per_task   = std::max( best.allocs_per_task, current.allocs_per_task );
+        best.elapsed           = std::min( best.elapsed, current.elapsed );
+        best.reference_elapsed = std::min( best.reference_elapsed, current.reference_elapsed );
+        best.p99               = std::min( best.p99, current.p99 );
+        best.reference_p99     = std::min( best.reference_p99, current.reference_p99 );
+    }
+
+    metrics result;
+    result.tx_per_task         = best.tx_per_task;
+    result.allocs_per_task     = best.allocs_per_task;
+    result.relative_throughput = best.reference_elapsed / best.elapsed;
+    result.relative_p99        = best.p99 / best.reference_p99;
+    result.tx_per_sec          = best.tx_per_task * load.tasks / best.elapsed;
+    result.p99_latency_us      = best.p99 * 1e6;
+    return result;
+}
+
+
+/* baseline files: "<key> = <value>" per line, '#' starts a comment */
+static std::map< std::string, double > load_baseline( const std::string &path ) {
+    std::map< std::string, double > baseline;
+
+    std::ifstream file( path );
+    std::string line;
+    while( std::getline( file, line ) ) {
+        if( line.empty() || ( line[0] == '#' ) )
+            continue;
+
+        std::istringstream line_stream( line );
+        std::string key, separator;
+        double value;
+        if( line_stream >> key >> separator >> value )
+            baseline[key] = value;
+    }
+
+    return baseline;
+}
+
+
+static void save_baseline( const std::string &path, const std::map< std::string, double > &baseline ) {
+    std::ofstream file( path );
+    file << "# Performance baseline of this machine, updated by perf_test --record\n";
+    for( auto &[key, value]: baseline )
+        file << key << " = " << value << "\n";
+}
+
+
+int main( int argc, char **argv ) {
+    std::string workload_name;
+    std::string reference_path;
+    std::string baseline_path;
+    std::string config = "default";
+    double tolerance = 25.0;
+    double reference_tolerance = 50.0;
+    bool record = false;
+
+    for( int i = 1; i < argc; ++i ) {
+        std::string arg = argv[i];
+        if( ( arg == "--workload" ) && ( i + 1 < argc ) )
+            workload_name = argv[++i];
+        else if( ( arg == "--reference" ) && ( i + 1 < argc ) )
+            reference_path = argv[++i];
+        else if( ( arg == "--baseline" ) && ( i + 1 < argc ) )
+            baseline_path = argv[++i];
+        else if( ( arg == "--config" ) && ( i + 1 < argc ) )
+            config = argv[++i];
+        else if( ( arg == "--tolerance" ) && ( i + 1 < argc ) )
+            tolerance = std::stod( argv[++i] );
+        else if( ( arg == "--reference-tolerance" ) && ( i + 1 < argc ) )
+            reference_tolerance = std::stod( argv[++i] );
+        else if( arg == "--record" )
+            record = true;
+        else {
+            std::cout << "unknown argument: " << arg << std::endl;
+            return 2;
+        }
+    }
+    if( workload_name.empty() || reference_path.empty() || baseline_path.empty() ) {
+        std::cout << "usage: perf_test --workload <hello|bulk|batched> --reference <file> --baseline <file>"
+                     " [--config <name>] [--tolerance <percent>] [--reference-tolerance <percent>] [--record]" << std::endl;
+        return 2;
+    }
+
+    std::unique_ptr< workload > load;
+    metrics current;
+    try {
+        load = std::make_unique< workload >( make_workload( workload_name ) );
+        current = measure( *load );
+    }
+    catch( std::exception &ex ) {
+        std::cout << workload_name << ": " << ex.what() << std::endl;
+        return 1;
+    }
+
+    bool failed = false;
+
+    /* counts do not depend on machine and build type, any change must update the file */
+    auto reference = load_baseline( reference_path );
+    const std::pair< const char*, double > exact_checks[] = {
+        { "tx_per_task",     current.tx_per_task     },
+        { "allocs_per_task", current.allocs_per_task }
+    };
+    for( auto &[name, value]: exact_checks ) {
+        const std::string key = workload_name + "." + name;
+        std::cout << key << " = " << value;
+
+        auto it = reference.find( key );
+        if( it == reference.end() ) {
+            std::cout << ", not in " << reference_path << ", FAILED" << std::endl;
+            failed = true;
+            continue;
+        }
+
+        bool changed = std::abs( value - it->second ) > 0.01;
+        std::cout << ", expected " << it->second << ( changed ? ", FAILED" : ", ok" ) << std::endl;
+        failed = failed || changed;
+    }
+
+    auto baseline = load_baseline( baseline_path );
+    const std::string prefix = workload_name + "." + config + ".";
+
+    /* direction of every timing: higher is better or lower is better */
+    struct metric_check {
+        const char       *name;
+        double metrics::*value;
+        bool              higher_is_better;
+    };
+    const metric_check checks[] = {
+        { "relative_throughput", &metrics::relative_throughput, true  },
+        { "relative_p99",        &metrics::relative_p99,        false }
+    };
+
+    if( record ) {
+        for( auto &check: checks ) {
+            baseline[ prefix + check.name ] = current.*check.value;
+            std::cout << prefix << check.name << " = " << current.*check.value << " (recorded)" << std::endl;
+        }
+        save_baseline( baseline_path, baseline );
+        return failed ? 1 : 0;
+    }
+
+    /* machine baseline is exact for this machine, committed reference only guards
+     * against big regressions everywhere, so it gets wider tolerance */
+    const std::map< std::string, double > *timings = &baseline;
+    double allowed_change = tolerance;
+    if( !baseline.count( prefix + checks[0].name ) ) {
+        timings = &reference;
+        allowed_change = reference_tolerance;
+    }
+    for( auto &check: checks ) {
+        if( !timings->count( prefix + check.name ) ) {
+            std::cout << prefix << check.name << " is neither in " << baseline_path << " nor in " << reference_path
+                      << ", record it with --record and add it to the reference, FAILED" << std::endl;
+            return 1;
+        }
+    }
+    std::cout << "timings are compared with "
+              << ( ( timings == &baseline ) ? baseline_path : reference_path ) << std::endl;
+
+    /* real regression repeats, noise of the machine seldom does twice in a row */
+    static const unsigned confirmations = 2;
+    for( unsigned attempt = 0; ; ++attempt ) {
+        std::cout << prefix << "tx_per_sec = " << current.tx_per_sec << " (checked as relative_throughput)" << std::endl;
+        std::cout << prefix << "p99_latency_us = " << current.p99_latency_us << " (checked as relative_p99)" << std::endl;
+
+        bool regressed = false;
+        for( auto &check: checks ) {
+            std::cout << prefix << check.name << " = " << current.*check.value;
+
+            double base = timings->at( prefix + check.name );
+            double allowed = check.higher_is_better ? base * ( 1.0 - allowed_change / 100.0 )
+                                                    : base * ( 1.0 + allowed_change / 100.0 );
+            bool worse = check.higher_is_better ? ( current.*check.value < allowed )
+                                                : ( current.*check.value > allowed );
+
+            std::cout << ", baseline " << base
+                      << ( worse ? ", REGRESSION" : ", ok" ) << std::endl;
+            regressed = regressed || worse;
+        }
+
+        if( !regressed )
+            break;
+        if( attempt == confirmations ) {
+            failed = true;
+            break;
+        }
+
+        std::cout << "measuring again to confirm regression" << std::endl;
+        try {
+            current = measure( *load );
+        }
+        catch( std::exception &ex ) {
+            std::cout << workload_name << ": " << ex.what() << std::endl;
+            return 1;
+        }
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,212 @@
+/* Tests of retry policy of typed device API on simulated bus with injected faults
+ *
+ * usage: policy_test --case <backoff|deadline|once|hedge|hedge_failover|hedge_same_handle|fraction> */
+
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "device.h"
+#include "fault_api.h"
+
+
+typedef std::chrono::milliseconds ms;
+
+
+static void expect( const bool condition, const std::string &text ) {
+    if( !condition )
+        throw std::runtime_error( text );
+}
+
+
+static retry_policy backoff_policy() {
+    retry_policy policy;
+    policy.timeout         = ms( 500 );
+    policy.max_attempts    = 10;
+    policy.initial_backoff = ms( 1 );
+    policy.max_backoff     = ms( 4 );
+    policy.backoff_factor  = 2;
+    return policy;
+}
+
+
+/* failed idempotent write is repeated after growing pauses until it goes through */
+static void test_backoff() {
+    device dev( 1 );
+    dev.set_policy( backoff_policy() );
+
+    fault_fail_next( 3 );
+    auto started = transaction_clock::now();
+    expect( dev.write( addresses::power_on ), "write is not repeated" );
+    auto elapsed = transaction_clock::now() - started;
+
+    expect( fault_calls( 1 ) == 4, "4 attempts expected, got " + std::to_string( fault_calls( 1 ) ) );
+    /* pauses are 1, 2 and 4 ms */
+    expect( elapsed >= ms( 7 ), "pauses between attempts are too short" );
+}
+
+
+/* retries stop at the deadline of the caller even when attempts are left */
+static void test_deadline() {
+    device dev( 1 );
+    dev.set_policy( backoff_policy() );
+
+    fault_fail_next( 1000 );
+    auto started  = transaction_clock::now();
+    auto deadline = started + ms( 20 );
+    expect( !dev.read( addresses::ready, deadline ), "read cannot succeed" );
+    auto finished = transaction_clock::now();
+
+    /* pauses 1, 2, 4, 4, 4 ms and the next one would go over the deadline */
+    expect( fault_calls( 1 ) >= 2, "read is not repeated" );
+    expect( fault_calls( 1 ) < 10, "attempts are not limited by the deadline" );
+    /* only oversleeping of the last pause can go beyond the deadline */
+    expect( finished < deadline + ms( 10 ), "deadline is not kept" );
+}
+
+
+/* command which is not idempotent is never repeated */
+static void test_once() {
+    device dev( 1 );
+    dev.set_policy( backoff_policy() );
+
+    fault_fail_next( 1 );
+    auto hello = addresses::hello;
+    hello.value = 0x100;
+    expect( !dev.write( hello ), "failed command must be reported" );
+    expect( fault_calls( 1 ) == 1, "command is repeated" );
+}
+
+
+/* device with two connections and history of fast reads which gives hedge threshold */
+static retry_policy hedge_policy( device &dev, const unsigned max_attempts ) {
+    retry_policy policy;
+    policy.timeout          = ms( 500 );
+    policy.max_attempts     = max_attempts;
+    policy.hedge_percentile = 0.9;
+    dev.set_policy( policy );
+
+    for( unsigned i = 0; i < 64; ++i )
+        expect( dev.read( addresses::ready ).has_value(), "warm up read failed" );
+
+    /* duplicate of the last warm up read can still be on the bus */
+    std::this_thread::sleep_for( ms( 5 ) );
+    return policy;
+}
+
+
+/* slow read which succeeds is overtaken by the duplicate, caller waits about the threshold */
+static void test_hedge() {
+    fault_distinct_handles( true );
+    {
+        device dev( 1 );
+        hedge_policy( dev, 3 );
+
+        fault_slow_handle( 1, ms( 50 ), false );
+        auto duplicates = fault_calls( 2 );
+        auto started = transaction_clock::now();
+        auto res = dev.read( addresses::ready );
+        auto elapsed = transaction_clock::now() - started;
+
+        expect( res && ( *res == 42 ), "read failed" );
+        expect( fault_calls( 2 ) > duplicates, "duplicate is not sent" );
+        expect( elapsed < ms( 20 ), "caller waits for the slow read: "
+                + std::to_string( std::chrono::duration_cast< ms >( elapsed ).count() ) + " ms" );
+
+        /* slow read is still on the bus, next transactions go through the other connection */
+        started = transaction_clock::now();
+        expect( dev.read( addresses::ready ).has_value(), "read after slow read failed" );
+        expect( dev.write( addresses::power_on ), "write after slow read failed" );
+        expect( transaction_clock::now() - started < ms( 20 ), "caller waits for the busy connection" );
+    }
+
+    /* one handle is never used by two threads */
+    expect( fault_max_in_flight() == 1, "connection is used concurrently" );
+    expect( fault_bad_closes() == 0, "connection is closed twice" );
+}
+
+
+/* read which fails slowly on one connection is answered by the duplicate */
+static void test_hedge_failover() {
+    fault_distinct_handles( true );
+    device dev( 1 );
+    hedge_policy( dev, 1 );  // answer can come only from the duplicate
+
+    fault_slow_handle( 1, ms( 20 ), true );
+    auto duplicates = fault_calls( 2 );
+    auto res = dev.read( addresses::ready );
+    expect( res && ( *res == 42 ), "duplicate answer is not used" );
+    expect( fault_calls( 2 ) > duplicates, "duplicate is not sent" );
+    expect( fault_max_in_flight() == 1, "connection is used concurrently" );
+}
+
+
+/* backend with one handle per device has no second connection, reads go without duplicates */
+static void test_hedge_same_handle() {
+    {
+        device dev( 1 );
+        hedge_policy( dev, 3 );
+
+        fault_slow_handle( 1, ms( 5 ), false );
+        expect( dev.read( addresses::ready ).has_value(), "slow read failed" );
+        expect( dev.write( addresses::power_on ), "write after slow read failed" );
+    }
+
+    expect( fault_max_in_flight() == 1, "connection is used concurrently" );
+    expect( fault_bad_closes() == 0, "connection is closed twice" );
+}
+
+
+/* hedge_percentile is a fraction, not a percent */
+static void test_fraction() {
+    device dev( 1 );
+
+    retry_policy policy;
+    policy.hedge_percentile = 99.0;
+    try {
+        dev.set_policy( policy );
+    }
+    catch( std::invalid_argument& ) {
+        return;
+    }
+    throw std::runtime_error( "percent value is accepted" );
+}
+
+
+int main( int argc, char **argv ) {
+    if( ( argc != 3 ) || ( std::string( argv[1] ) != "--case" ) ) {
+        std::cout << "usage: policy_test --case <backoff|deadline|once|hedge|hedge_failover|hedge_same_handle|fraction>" << std::endl;
+        return 2;
+    }
+
+    const std::string name = argv[2];
+    try {
+        if( name == "backoff" )
+            test_backoff();
+        else if( name == "deadline" )
+            test_deadline();
+        else if( name == "once" )
+            test_once();
+        else if( name == "hedge" )
+            test_hedge();
+        else if( name == "hedge_failover" )
+            test_hedge_failover();
+        else if( name == "hedge_same_handle" )
+            test_hedge_same_handle();
+        else if( name == "fraction" )
+            test_fraction();
+        else {
+            std::cout << "unknown case: " << name << std::endl;
+            return 2;
+        }
+    }
+    catch( std::exception &ex ) {
+        std::cout << name << ": " << ex.what() << std::endl;
+        return 1;
+    }
+
+    std::cout << name << ": ok" << std::endl;
+    return 0;
+}
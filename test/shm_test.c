@@ -0,0 +1,611 @@
+/* Tests of shared-memory transport with real broker process: concurrent clients,
+ * abandoned call, stalled tickets, killed broker and wake-up of idle broker;
+ * repeating of broken frames is tested against a broker thread which breaks them
+ *
+ * usage: shm_test --broker <path> --case <concurrent|abandon|stall|restart|wakeup|frame_request|frame_response> */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "api.h"
+#include "api_shm.h"
+#include "crc32c.h"
+
+
+/* clients of concurrent case */
+#define CLIENT_PROCESSES 4
+#define CLIENT_THREADS   4
+#define CLIENT_ROUNDS    300
+
+
+static const char *broker_path = NULL;
+static const char *case_name   = "";
+static char        region_name[64];
+static pid_t       broker      = 0;
+static pid_t       test_pid    = 0;
+
+
+static uint64_t now_ms( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+
+static void sleep_ms( unsigned ms ) {
+    struct timespec ts = { ms / 1000, (long)( ms % 1000 ) * 1000000L };
+    nanosleep( &ts, NULL );
+}
+
+
+/* broker and its region must not outlive the test, forked clients leave them alone */
+static void cleanup( void ) {
+    if( getpid() != test_pid )
+        return;
+
+    if( broker > 0 ) {
+        kill( broker, SIGKILL );
+        waitpid( broker, NULL, 0 );
+    }
+    shm_unlink( region_name );
+}
+
+
+static void fail( const char *text ) {
+    printf( "%s: %s\n", case_name, text );
+    exit( 1 );
+}
+
+
+static struct shm_region* map_region( void ) {
+    int fd = shm_open( region_name, O_RDWR, 0 );
+    if( fd < 0 )
+        return NULL;
+
+    void *mapped = mmap( NULL, sizeof( struct shm_region ),
+                         PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    return ( mapped == MAP_FAILED ) ? NULL : (struct shm_region*)mapped;
+}
+
+
+/* broker output is not interesting, the test checks what clients get */
+static void start_broker( void ) {
+    broker = fork();
+    if( broker < 0 )
+        fail( "cannot fork broker" );
+
+    if( broker == 0 ) {
+        int null_fd = open( "/dev/null", O_WRONLY );
+        dup2( null_fd, STDOUT_FILENO );
+        dup2( null_fd, STDERR_FILENO );
+        execl( broker_path, broker_path, region_name, (char*)NULL );
+        _exit( 127 );
+    }
+
+    for( unsigned i = 0; i < 300; ++i ) {
+        struct shm_region *region = map_region();
+        if( region ) {
+            int ready = ( atomic_load( &region->magic ) == SHM_MAGIC ) && ( region->broker_pid == broker );
+            munmap( region, sizeof( struct shm_region ) );
+            if( ready )
+                return;
+        }
+        sleep_ms( 10 );
+    }
+    fail( "broker does not start" );
+}
+
+
+/* open, write, read and close like a device task, returns zero on success */
+static int exchange( uint8_t dev_id ) {
+    conn_h conn = connection_open( dev_id );
+    if( conn == INVALID_CONNECTION )
+        return -1;
+
+    int res = 0;
+    uint16_t hello = 0x100;
+    uint8_t ready = 0;
+    if( connection_write( conn, 0x10, 0xA0, &hello, sizeof( hello ) ) != sizeof( hello ) )
+        res = -1;
+    else if( ( connection_read( conn, 0xAA, 0xFF, &ready, sizeof( ready ) ) != sizeof( ready ) )
+          || ( ready != 42 ) )
+        res = -1;
+
+    connection_close( conn );
+    return res;
+}
+
+
+static void* client_thread( void *arg ) {
+    uint8_t dev_id = (uint8_t)(uintptr_t)arg;
+    for( unsigned i = 0; i < CLIENT_ROUNDS; ++i )
+        if( exchange( dev_id ) )
+            return (void*)1;
+    return NULL;
+}
+
+
+/* several processes with several threads each share the ring, it wraps many times */
+static void test_concurrent( void ) {
+    pid_t clients[CLIENT_PROCESSES];
+    for( unsigned p = 0; p < CLIENT_PROCESSES; ++p ) {
+        clients[p] = fork();
+        if( clients[p] < 0 )
+            fail( "cannot fork client" );
+        if( clients[p] )
+            continue;
+
+        pthread_t threads[CLIENT_THREADS];
+        for( unsigned t = 0; t < CLIENT_THREADS; ++t )
+            pthread_create( &threads[t], NULL, client_thread, (void*)(uintptr_t)( 1 + ( p + t ) % 4 ) );
+
+        int failed = 0;
+        for( unsigned t = 0; t < CLIENT_THREADS; ++t ) {
+            void *res;
+            pthread_join( threads[t], &res );
+            failed |= ( res != NULL );
+        }
+        _exit( failed );
+    }
+
+    int failed = 0;
+    for( unsigned p = 0; p < CLIENT_PROCESSES; ++p ) {
+        int status;
+        waitpid( clients[p], &status, 0 );
+        failed |= !WIFEXITED( status ) || WEXITSTATUS( status );
+    }
+    if( failed )
+        fail( "transaction of concurrent client failed" );
+}
+
+
+/* client gives up a call of stopped broker, the slot is released after the broker continues */
+static void test_abandon( void ) {
+    if( exchange( 1 ) )
+        fail( "transaction before stop failed" );
+
+    kill( broker, SIGSTOP );
+    uint64_t started = now_ms();
+    conn_h conn = connection_open( 1 );
+    uint64_t elapsed = now_ms() - started;
+    kill( broker, SIGCONT );
+
+    if( conn != INVALID_CONNECTION )
+        fail( "call to stopped broker succeeded" );
+    if( ( elapsed < SHM_CALL_TIMEOUT_MS - 50 ) || ( elapsed > SHM_CALL_TIMEOUT_MS + 1000 ) )
+        fail( "call is not given up after its timeout" );
+
+    /* the ring wraps over the abandoned slot several times */
+    for( unsigned i = 0; i < 2 * SHM_RING_SLOTS; ++i )
+        if( exchange( 1 ) )
+            fail( "transaction after abandoned call failed" );
+}
+
+
+/* ticket is taken by a process which dies before it claims the slot or while it writes */
+static void dead_client( int claim ) {
+    pid_t child = fork();
+    if( child < 0 )
+        fail( "cannot fork client" );
+
+    if( child == 0 ) {
+        struct shm_region *region = map_region();
+        if( !region )
+            _exit( 1 );
+
+        uint64_t ticket = atomic_fetch_add( &region->head, 1 );
+        if( claim ) {
+            struct shm_slot *slot = &region->slots[ ticket % SHM_RING_SLOTS ];
+            uint64_t control = SHM_CONTROL( ticket, SHM_SLOT_FREE );
+            while( !atomic_compare_exchange_weak( &slot->control, &control, SHM_CONTROL( ticket, SHM_SLOT_WRITING ) ) )
+                control = SHM_CONTROL( ticket, SHM_SLOT_FREE );
+            atomic_store( &slot->writer, getpid() );
+            memset( &slot->frame, 0xAB, sizeof( slot->frame ) );
+        }
+        _exit( 0 );
+    }
+
+    waitpid( child, NULL, 0 );
+}
+
+
+/* stalled tickets of dead clients are skipped, slot claimed by live writer is never taken back */
+static void test_stall( void ) {
+    dead_client( 0 );
+    if( exchange( 1 ) )
+        fail( "ticket taken by dead client is not skipped" );
+
+    dead_client( 1 );
+    if( exchange( 1 ) )
+        fail( "slot claimed by dead writer is not taken back" );
+
+    /* this process claims a slot and writes request slowly */
+    struct shm_region *region = map_region();
+    if( !region )
+        fail( "cannot map region" );
+
+    uint64_t ticket = atomic_fetch_add( &region->head, 1 );
+    struct shm_slot *slot = &region->slots[ ticket % SHM_RING_SLOTS ];
+    uint64_t control = SHM_CONTROL( ticket, SHM_SLOT_FREE );
+    uint64_t started = now_ms();
+    while( !atomic_compare_exchange_weak( &slot->control, &control, SHM_CONTROL( ticket, SHM_SLOT_WRITING ) ) ) {
+        if( now_ms() - started > SHM_CALL_TIMEOUT_MS )
+            fail( "slot is not released" );
+        control = SHM_CONTROL( ticket, SHM_SLOT_FREE );
+    }
+    atomic_store( &slot->writer, getpid() );
+
+    sleep_ms( 3 * SHM_STALL_TIMEOUT_MS );
+    if( atomic_load( &slot->control ) != SHM_CONTROL( ticket, SHM_SLOT_WRITING ) )
+        fail( "slot of live writer is taken back" );
+
+    memset( &slot->frame, 0, sizeof( slot->frame ) );
+    slot->frame.seq        = (uint32_t)ticket;
+    slot->frame.op         = SHM_OP_READ;
+    slot->frame.handle     = 1;
+    slot->frame.upper_addr = 0xAA;
+    slot->frame.lower_addr = 0xFF;
+    slot->frame.data_len   = 1;
+    atomic_store( &slot->control, SHM_CONTROL( ticket, SHM_SLOT_REQUEST ) );
+
+    started = now_ms();
+    while( atomic_load( &slot->control ) != SHM_CONTROL( ticket, SHM_SLOT_RESPONSE ) )
+        if( now_ms() - started > SHM_CALL_TIMEOUT_MS )
+            fail( "request of slow writer is not served" );
+    if( ( slot->frame.result != 1 ) || ( slot->frame.data[0] != 42 ) )
+        fail( "wrong response to slow writer" );
+
+    atomic_store( &slot->writer, 0 );
+    atomic_store( &slot->control, SHM_CONTROL( ticket + SHM_RING_SLOTS, SHM_SLOT_FREE ) );
+    munmap( region, sizeof( struct shm_region ) );
+
+    if( exchange( 1 ) )
+        fail( "transaction after slow writer failed" );
+}
+
+
+static void* blocked_call( void *arg ) {
+    uint64_t *elapsed = (uint64_t*)arg;
+    uint64_t started = now_ms();
+    conn_h conn = connection_open( 1 );
+    *elapsed = now_ms() - started;
+    return ( conn == INVALID_CONNECTION ) ? NULL : (void*)1;
+}
+
+
+/* killed broker is noticed by waiting and by new calls, restarted one serves the same clients */
+static void test_restart( void ) {
+    if( exchange( 1 ) )
+        fail( "transaction before kill failed" );
+
+    /* call is waiting for stopped broker when it is killed */
+    kill( broker, SIGSTOP );
+    pthread_t thread;
+    uint64_t elapsed = 0;
+    pthread_create( &thread, NULL, blocked_call, &elapsed );
+    sleep_ms( 100 );
+    kill( broker, SIGKILL );
+    waitpid( broker, NULL, 0 );
+    broker = 0;
+
+    void *res;
+    pthread_join( thread, &res );
+    if( res )
+        fail( "call to killed broker succeeded" );
+    if( elapsed > SHM_CALL_TIMEOUT_MS - 100 )
+        fail( "waiting call does not notice killed broker" );
+
+    uint64_t started = now_ms();
+    if( connection_open( 1 ) != INVALID_CONNECTION )
+        fail( "call to dead broker succeeded" );
+    if( now_ms() - started > 100 )
+        fail( "new call does not notice dead broker" );
+
+    start_broker();
+    for( unsigned i = 0; i < 2 * SHM_RING_SLOTS; ++i )
+        if( exchange( 1 ) )
+            fail( "transaction after restart failed" );
+}
+
+
+static int compare_ms( const void *a, const void *b ) {
+    uint64_t left = *(const uint64_t*)a, right = *(const uint64_t*)b;
+    return ( left > right ) - ( left < right );
+}
+
+
+/* sleeping broker is woken by the doorbell, not by timeout of its sleep */
+static void test_wakeup( void ) {
+    enum { SAMPLES = 9 };
+
+    struct shm_region *region = map_region();
+    if( !region )
+        fail( "cannot map region" );
+
+    conn_h conn = connection_open( 1 );
+    if( conn == INVALID_CONNECTION )
+        fail( "cannot open connection" );
+
+    uint64_t latencies[SAMPLES];
+    unsigned sleeping = 0;
+    for( unsigned i = 0; i < SAMPLES; ++i ) {
+        sleep_ms( 50 );
+        sleeping += atomic_load( &region->broker_sleeping ) != 0;
+
+        struct timespec before, after;
+        uint8_t ready;
+        clock_gettime( CLOCK_MONOTONIC, &before );
+        if( connection_read( conn, 0xAA, 0xFF, &ready, sizeof( ready ) ) != sizeof( ready ) )
+            fail( "read from idle broker failed" );
+        clock_gettime( CLOCK_MONOTONIC, &after );
+        latencies[i] = (uint64_t)( after.tv_sec - before.tv_sec ) * 1000000u
+                     + (uint64_t)( after.tv_nsec - before.tv_nsec ) / 1000u;
+    }
+    connection_close( conn );
+    munmap( region, sizeof( struct shm_region ) );
+
+    if( sleeping < SAMPLES / 2 )
+        fail( "idle broker does not sleep" );
+
+    /* without the doorbell the broker answers after its sleep of 10 ms, about 5 ms on average */
+    qsort( latencies, SAMPLES, sizeof( latencies[0] ), compare_ms );
+    if( latencies[ SAMPLES / 2 ] > 2000 ) {
+        printf( "%s: median latency after idle is %llu us\n", case_name, (unsigned long long)latencies[ SAMPLES / 2 ] );
+        fail( "idle broker is not woken by the doorbell" );
+    }
+}
+
+
+/* broker thread of framed region, breaks frames on the way in both directions */
+static struct {
+    struct shm_region *region;
+    pthread_t          thread;
+    _Atomic int        stop;
+    _Atomic unsigned   broken_requests;     // next requests are broken before the broker checks them
+    _Atomic unsigned   broken_responses;    // next responses are broken after the broker seals them
+    _Atomic unsigned   executed[SHM_OP_READ + 1];
+} framer;
+
+
+static int take_one( _Atomic unsigned *counter ) {
+    unsigned pending = atomic_load( counter );
+    while( pending && !atomic_compare_exchange_weak( counter, &pending, pending - 1 ) )
+        ;
+    return pending != 0;
+}
+
+
+/* device answers like api_impl.c: handle is device ID, every read gives 42 */
+static void framer_execute( struct shm_frame *frame ) {
+    if( frame->op <= SHM_OP_READ )
+        atomic_fetch_add( &framer.executed[frame->op], 1 );
+
+    switch( frame->op ) {
+    case SHM_OP_OPEN:
+        frame->result = frame->handle;
+        break;
+    case SHM_OP_CLOSE:
+        frame->result = 0;
+        break;
+    case SHM_OP_READ:
+        memset( frame->data, 0, sizeof( frame->data ) );
+        frame->data[0] = 42;
+        /* fall through */
+    case SHM_OP_WRITE:
+        frame->result = (int32_t)frame->data_len;
+        break;
+    default:
+        frame->result = -1;
+        break;
+    }
+}
+
+
+static void* framer_serve( void *arg ) {
+    (void)arg;
+    struct shm_region *region = framer.region;
+    uint64_t tail = 0;
+    while( !atomic_load( &framer.stop ) ) {
+        struct shm_slot *slot = &region->slots[ tail % SHM_RING_SLOTS ];
+        if( atomic_load( &slot->control ) != SHM_CONTROL( tail, SHM_SLOT_REQUEST ) ) {
+            sched_yield();
+            continue;
+        }
+
+        if( take_one( &framer.broken_requests ) )
+            slot->frame.upper_addr ^= 0x01;
+
+        enum shm_slot_phase phase = SHM_SLOT_REJECTED;
+        if( slot->crc == crc32c( &slot->frame, sizeof( struct shm_frame ) ) ) {
+            framer_execute( &slot->frame );
+            slot->crc = crc32c( &slot->frame, sizeof( struct shm_frame ) );
+            if( take_one( &framer.broken_responses ) )
+                slot->frame.data[SHM_MAX_PAYLOAD - 1] ^= 0x80;
+            phase = SHM_SLOT_RESPONSE;
+        }
+
+        /* the client gives the slot to the next round */
+        atomic_store( &slot->control, SHM_CONTROL( tail, phase ) );
+        ++tail;
+    }
+    return NULL;
+}
+
+
+static void stop_framer( void ) {
+    if( getpid() != test_pid )
+        return;
+
+    atomic_store( &framer.stop, 1 );
+    pthread_join( framer.thread, NULL );
+}
+
+
+/* region with frame check is served by this process */
+static void start_framer( void ) {
+    int fd = shm_open( region_name, O_CREAT | O_EXCL | O_RDWR, 0660 );
+    if( ( fd < 0 ) || ( ftruncate( fd, sizeof( struct shm_region ) ) < 0 ) )
+        fail( "cannot create region" );
+    void *mapped = mmap( NULL, sizeof( struct shm_region ),
+                         PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if( mapped == MAP_FAILED )
+        fail( "cannot map region" );
+
+    struct shm_region *region = (struct shm_region*)mapped;
+    memset( region, 0, sizeof( struct shm_region ) );
+    for( uint32_t i = 0; i < SHM_RING_SLOTS; ++i )
+        atomic_store( &region->slots[i].control, SHM_CONTROL( i, SHM_SLOT_FREE ) );
+    region->version    = SHM_VERSION;
+    region->flags      = SHM_FLAG_FRAMED;
+    region->broker_pid = getpid();
+    atomic_store( &region->broker_alive, 1 );
+    atomic_store( &region->magic, SHM_MAGIC );
+
+    framer.region = region;
+    pthread_create( &framer.thread, NULL, framer_serve, NULL );
+    atexit( stop_framer );
+}
+
+
+/* one call of op through api.h, returns non-zero when the caller gets success */
+static int frame_call( enum shm_op op ) {
+    uint16_t hello = 0x100;
+    uint8_t ready = 0;
+
+    for( unsigned i = 0; i <= SHM_OP_READ; ++i )
+        atomic_store( &framer.executed[i], 0 );
+
+    switch( op ) {
+    case SHM_OP_OPEN:
+        return connection_open( 1 ) == 1;
+    case SHM_OP_CLOSE:
+        connection_close( 1 );
+        return 1;
+    case SHM_OP_WRITE:
+        return connection_write( 1, 0x10, 0xA0, &hello, sizeof( hello ) ) == sizeof( hello );
+    case SHM_OP_READ:
+        return ( connection_read( 1, 0xAA, 0xFF, &ready, sizeof( ready ) ) == sizeof( ready ) ) && ( ready == 42 );
+    }
+    return 0;
+}
+
+
+static const char* op_name( enum shm_op op ) {
+    static const char *names[] = { "", "open", "close", "write", "read" };
+    return names[op];
+}
+
+
+static void expect_frames( int condition, enum shm_op op, const char *text ) {
+    if( !condition ) {
+        printf( "%s: %s: %s\n", case_name, op_name( op ), text );
+        exit( 1 );
+    }
+}
+
+
+/* broken request is rejected before execution, so every operation is repeated within the budget */
+static void test_frame_request( void ) {
+    start_framer();
+
+    for( enum shm_op op = SHM_OP_OPEN; op <= SHM_OP_READ; ++op ) {
+        atomic_store( &framer.broken_requests, SHM_FRAME_RETRIES );
+        int ok = frame_call( op );
+        expect_frames( ok, op, "rejected request is not repeated" );
+        expect_frames( atomic_load( &framer.executed[op] ) == 1, op, "repeated request is executed more than once" );
+        expect_frames( atomic_load( &framer.broken_requests ) == 0, op, "request is repeated too few times" );
+
+        atomic_store( &framer.broken_requests, SHM_FRAME_RETRIES + 2 );
+        ok = frame_call( op );
+        expect_frames( !ok || ( op == SHM_OP_CLOSE ), op, "broken request is accepted" );
+        expect_frames( atomic_load( &framer.executed[op] ) == 0, op, "broken request is executed" );
+        expect_frames( atomic_load( &framer.broken_requests ) == 1, op, "request is repeated beyond the budget" );
+        atomic_store( &framer.broken_requests, 0 );
+    }
+}
+
+
+/* broken response comes from executed request, only reading can be repeated safely */
+static void test_frame_response( void ) {
+    start_framer();
+
+    for( enum shm_op op = SHM_OP_OPEN; op <= SHM_OP_READ; ++op ) {
+        atomic_store( &framer.broken_responses, 1 );
+        int ok = frame_call( op );
+        if( op == SHM_OP_READ ) {
+            expect_frames( ok, op, "read with broken response is not repeated" );
+            expect_frames( atomic_load( &framer.executed[op] ) == 2, op, "read is not executed again" );
+        }
+        else {
+            expect_frames( !ok || ( op == SHM_OP_CLOSE ), op, "broken response is accepted" );
+            expect_frames( atomic_load( &framer.executed[op] ) == 1, op, "request which is not idempotent is repeated" );
+        }
+        expect_frames( atomic_load( &framer.broken_responses ) == 0, op, "broken response is not noticed" );
+    }
+
+    /* reading gives up when the budget is spent */
+    atomic_store( &framer.broken_responses, SHM_FRAME_RETRIES + 2 );
+    expect_frames( !frame_call( SHM_OP_READ ), SHM_OP_READ, "broken response is accepted" );
+    expect_frames( atomic_load( &framer.executed[SHM_OP_READ] ) == 1 + SHM_FRAME_RETRIES, SHM_OP_READ,
+                   "read is not repeated exactly within the budget" );
+}
+
+
+int main( int argc, char **argv ) {
+    for( int i = 1; i + 1 < argc; i += 2 ) {
+        if( !strcmp( argv[i], "--broker" ) )
+            broker_path = argv[i + 1];
+        else if( !strcmp( argv[i], "--case" ) )
+            case_name = argv[i + 1];
+    }
+    if( !broker_path || !*case_name ) {
+        printf( "usage: shm_test --broker <path> --case <concurrent|abandon|stall|restart|wakeup|frame_request|frame_response>\n" );
+        return 2;
+    }
+
+    void ( *test )( void ) = NULL;
+    if( !strcmp( case_name, "concurrent" ) )
+        test = test_concurrent;
+    else if( !strcmp( case_name, "abandon" ) )
+        test = test_abandon;
+    else if( !strcmp( case_name, "stall" ) )
+        test = test_stall;
+    else if( !strcmp( case_name, "restart" ) )
+        test = test_restart;
+    else if( !strcmp( case_name, "wakeup" ) )
+        test = test_wakeup;
+    else if( !strcmp( case_name, "frame_request" ) )
+        test = test_frame_request;
+    else if( !strcmp( case_name, "frame_response" ) )
+        test = test_frame_response;
+    else {
+        printf( "unknown case: %s\n", case_name );
+        return 2;
+    }
+
+    /* tests run in parallel and never meet the default region */
+    test_pid = getpid();
+    snprintf( region_name, sizeof( region_name ), "/safe_api_test_%s_%d", case_name, (int)test_pid );
+    setenv( SHM_NAME_ENV, region_name, 1 );
+    atexit( cleanup );
+
+    /* frame tests serve the region by themselves */
+    if( strncmp( case_name, "frame_", 6 ) )
+        start_broker();
+    test();
+
+    printf( "%s: ok\n", case_name );
+    return 0;
+}
@@ -0,0 +1,67 @@
+/* Simulated bus for tests: same answers as api_impl.c but without console output,
+ * so measurements show the cost of the library and not of printf */
+
+#include <atomic>
+#include <cstring>
+
+extern "C" {
+#include <api.h>
+}
+
+
+namespace {
+
+std::atomic< unsigned long > transactions { 0 };
+
+}
+
+
+/* number of transactions since start, used by tests to check workload size */
+unsigned long sim_transactions() {
+    return transactions.load( std::memory_order_relaxed );
+}
+
+
+extern "C" {
+
+conn_h connection_open( uint8_t dev_id ) {
+    // valid range is 1..4
+    if( ( !dev_id ) || ( dev_id > 5 ) )
+        return INVALID_CONNECTION;
+
+    return dev_id;
+}
+
+
+void connection_close( conn_h handle ) {
+    (void)handle;
+}
+
+
+int connection_write( conn_h handle,
+                      uint8_t upper_addr, uint8_t lower_addr,
+                      void *data_ptr, size_t data_len ) {
+    (void)handle; (void)upper_addr; (void)lower_addr; (void)data_ptr;
+    if( ( !data_len ) || ( data_len > 8 ) )
+        return -1;
+
+    transactions.fetch_add( 1, std::memory_order_relaxed );
+    return (int)data_len;
+}
+
+
+int connection_read( conn_h handle,
+                     uint8_t upper_addr, uint8_t lower_addr,
+                     void *data_ptr, size_t data_len ) {
+    (void)handle; (void)upper_addr; (void)lower_addr;
+    if( ( !data_len ) || ( data_len > 8 ) )
+        return -1;
+
+    std::memset( data_ptr, 0, data_len );
+    *static_cast< uint8_t* >( data_ptr ) = 42; // universal answer
+
+    transactions.fetch_add( 1, std::memory_order_relaxed );
+    return (int)data_len;
+}
+
+}